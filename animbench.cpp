@@ -0,0 +1,101 @@
+// Microbenchmark of the instance animation: the model matrices computed
+// with the glm::translate / glm::rotate chain practica_cubo used to run
+// per instance, against the batch kernels of animation.h. Prints the
+// matrices per second of each one and their largest difference with glm
+//
+// Usage: animbench [--instances N] [--frames N]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include <glm/gtc/type_ptr.hpp>
+#include "animation.h"
+
+// The original per-instance chain
+void glm_models(const AnimationParams &params, size_t first, size_t count, float time, float *models)
+{
+  for (size_t n = 0; n < count; n++)
+  {
+    size_t i = first + n;
+    float t = time + params.phase[i];
+    float f = t * 0.3f;
+    glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(params.x[i], params.y[i], params.z[i]));
+    model = glm::translate(model, glm::vec3(sinf(2.1f * f) * 0.5f, cosf(1.7f * f) * 0.5f, sinf(1.3f * f) * cosf(1.5f * f) * 2.0f));
+    model = glm::rotate(model, t * params.yaw_speed[i], glm::vec3(0.0f, 1.0f, 0.0f));
+    model = glm::rotate(model, t * params.pitch_speed[i], glm::vec3(1.0f, 0.0f, 0.0f));
+    memcpy(models + n * 16, glm::value_ptr(model), sizeof(model));
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  int instances = 100000;
+  int frames = 100;
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--instances") && i + 1 < argc)
+      instances = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+      frames = std::max(1, atoi(argv[++i]));
+    else
+    {
+      fprintf(stderr, "Usage: %s [--instances N] [--frames N]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  // Same parameters as practica_cubo's instance grid
+  AnimationParams params;
+  params.resize(instances);
+  for (int i = 0; i < instances; i++)
+  {
+    params.x[i] = (i % 47) * 1.5f;
+    params.y[i] = (i / 47 % 47) * 1.5f;
+    params.z[i] = -4.0f - i / (47 * 47) * 1.5f;
+    params.phase[i] = fmodf(i * 0.618034f, 1.0f) * 10.0f;
+    params.yaw_speed[i] = glm::radians(45.0f);
+    params.pitch_speed[i] = glm::radians(81.0f);
+  }
+
+  struct
+  {
+    const char *name;
+    AnimationKernel models;
+  } kernels[] = {
+    {"glm", glm_models},
+    {"scalar", anim_models_scalar},
+#ifdef ANIM_X86
+    {"sse2", anim_models_sse2},
+    {"avx2", __builtin_cpu_supports("avx2") ? anim_models_avx2 : NULL},
+#endif
+  };
+
+  std::vector<float> reference(instances * 16), models(instances * 16);
+  printf("%d instances, %d frames, %s kernels picked at runtime\n", instances, frames, anim_kernels().name);
+  printf("%-8s %12s %14s %12s %10s\n", "kernel", "ms/frame", "matrices/s", "max error", "speedup");
+  double glm_ms = 0.0;
+  for (const auto &kernel : kernels)
+  {
+    if (!kernel.models)
+      continue;
+    float max_error = 0.0f;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++)
+      kernel.models(params, 0, instances, frame / 60.0f, &models[0]);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / frames;
+
+    // Check the last frame, a long way into the animation
+    glm_models(params, 0, instances, (frames - 1) / 60.0f, &reference[0]);
+    for (size_t i = 0; i < models.size(); i++)
+      max_error = std::max(max_error, fabsf(models[i] - reference[i]));
+    if (kernel.models == glm_models)
+      glm_ms = ms;
+    printf("%-8s %12.3f %14.0f %12.2e %9.2fx\n", kernel.name, ms, instances / (ms / 1000.0), max_error,
+           glm_ms / ms);
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+// Asset pipeline step: builds the mip chain of each image, block
+// compresses it and stores it next to it as <image>.dds, which
+// practica_cubo uploads with glCompressedTexSubImage2D
+//
+// Usage: bcenc [--format bc1|bc3|bc7] [--filter box|kaiser|lanczos] [--threads N] image...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "bcenc.h"
+
+int main(int argc, char *argv[])
+{
+  MipFormat format = MIP_FORMAT_BC7;
+  MipFilter filter = MIP_FILTER_KAISER;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  int first_image = 1;
+  for (; first_image < argc && !strncmp(argv[first_image], "--", 2); first_image++)
+  {
+    if (!strcmp(argv[first_image], "--format") && first_image + 1 < argc)
+    {
+      const char *name = argv[++first_image];
+      int f = MIP_FORMAT_BC1;
+      while (f < NUM_MIP_FORMATS && strcmp(name, mip_format_names[f]))
+        f++;
+      if (f == NUM_MIP_FORMATS)
+      {
+        fprintf(stderr, "ERROR: unknown format %s\n", name);
+        return 1;
+      }
+      format = (MipFormat)f;
+    }
+    else if (!strcmp(argv[first_image], "--filter") && first_image + 1 < argc)
+    {
+      const char *name = argv[++first_image];
+      int f = 0;
+      while (f < NUM_MIP_FILTERS && strcmp(name, mip_filter_names[f]))
+        f++;
+      if (f == NUM_MIP_FILTERS)
+      {
+        fprintf(stderr, "ERROR: unknown filter %s\n", name);
+        return 1;
+      }
+      filter = (MipFilter)f;
+    }
+    else if (!strcmp(argv[first_image], "--threads") && first_image + 1 < argc)
+      threads = std::max(1, atoi(argv[++first_image]));
+    else
+      break;
+  }
+  if (first_image >= argc)
+  {
+    fprintf(stderr, "Usage: %s [--format bc1|bc3|bc7] [--filter box|kaiser|lanczos] [--threads N] image...\n",
+            argv[0]);
+    return 1;
+  }
+
+  // Same orientation as the textures loaded by practica_cubo
+  stbi_set_flip_vertically_on_load(1);
+  printf("%s, %s filter, %d threads, %s kernels\n", mip_format_names[format], mip_filter_names[filter], threads,
+         bc_kernels().name);
+
+  int failed = 0;
+  for (int i = first_image; i < argc; i++)
+  {
+    int width, height, channels;
+    unsigned char *pixels = stbi_load(argv[i], &width, &height, &channels, 4);
+    if (!pixels)
+    {
+      fprintf(stderr, "ERROR: could not load %s\n", argv[i]);
+      failed++;
+      continue;
+    }
+
+    MipChain chain, compressed;
+    mip_generate(pixels, width, height, filter, true, chain);
+    stbi_image_free(pixels);
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    bc_encode_chain(chain, format, threads, compressed);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::string path = bc_dds_path(argv[i]);
+    if (!bc_save_dds(path.c_str(), compressed))
+    {
+      fprintf(stderr, "ERROR: could not write %s\n", path.c_str());
+      failed++;
+      continue;
+    }
+    printf("%s: %dx%d, %d levels, %zu -> %zu bytes, encoded in %.2f ms (%.1f Mtexel/s)\n", path.c_str(), width,
+           height, chain.levels, chain.data.size(), compressed.data.size(), ms,
+           chain.data.size() / 4 / (ms * 1000.0));
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,519 @@
+// Block compression of mip chains to BC1 (opaque DXT1), BC3 (DXT5) and
+// BC7 (mode 6 only), and the .dds files that store them.
+//
+// Each 4x4 block is fitted with a line along its principal axis; the
+// projection of the 16 texels onto the line, which picks their indices,
+// has SSE2 and AVX2 versions picked at runtime on x86. Levels are split
+// in rows of blocks over several threads.
+//
+// The .dds files keep the rows bottom to top like the .mips ones, ready
+// for glCompressedTexSubImage2D; other DDS tools will show them flipped
+
+#ifndef BCENC_H
+#define BCENC_H
+
+#include "mipmap.h"
+#include <thread>
+
+const char *const mip_format_names[NUM_MIP_FORMATS] = {"rgba8", "bc1", "bc3", "bc7"};
+
+// ---- Index selection ----
+
+// Texels of a block as separate channels, 0..255
+struct BcBlock
+{
+  float r[16], g[16], b[16], a[16];
+};
+
+// index[i] = dot(texel i - origin, axis) rounded and clamped to [0, steps]
+typedef void (*BcProjectKernel)(const BcBlock &block, const float origin[4], const float axis[4], int steps,
+                                uint8_t index[16]);
+
+inline void bc_project_scalar(const BcBlock &block, const float origin[4], const float axis[4], int steps,
+                              uint8_t index[16])
+{
+  for (int i = 0; i < 16; i++)
+  {
+    float t = (block.r[i] - origin[0]) * axis[0] + (block.g[i] - origin[1]) * axis[1] +
+              (block.b[i] - origin[2]) * axis[2] + (block.a[i] - origin[3]) * axis[3];
+    index[i] = (uint8_t)std::min(std::max((int)floorf(t + 0.5f), 0), steps);
+  }
+}
+
+#ifdef MIP_X86
+__attribute__((target("sse2"))) inline void bc_project_sse2(const BcBlock &block, const float origin[4],
+                                                            const float axis[4], int steps, uint8_t index[16])
+{
+  const float *channels[4] = {block.r, block.g, block.b, block.a};
+  __m128i max_index = _mm_set1_epi32(steps);
+  for (int i = 0; i < 16; i += 4)
+  {
+    __m128 t = _mm_set1_ps(0.5f);
+    for (int c = 0; c < 4; c++)
+      t = _mm_add_ps(t, _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(channels[c] + i), _mm_set1_ps(origin[c])),
+                                   _mm_set1_ps(axis[c])));
+    // Truncation is floor for t >= 0, and negative values clamp to 0 anyway
+    __m128i k = _mm_cvttps_epi32(_mm_max_ps(t, _mm_setzero_ps()));
+    __m128i over = _mm_cmpgt_epi32(k, max_index);
+    k = _mm_or_si128(_mm_and_si128(over, max_index), _mm_andnot_si128(over, k));
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, k);
+    for (int j = 0; j < 4; j++)
+      index[i + j] = (uint8_t)lanes[j];
+  }
+}
+
+__attribute__((target("avx2"))) inline void bc_project_avx2(const BcBlock &block, const float origin[4],
+                                                            const float axis[4], int steps, uint8_t index[16])
+{
+  const float *channels[4] = {block.r, block.g, block.b, block.a};
+  for (int i = 0; i < 16; i += 8)
+  {
+    __m256 t = _mm256_set1_ps(0.5f);
+    for (int c = 0; c < 4; c++)
+      t = _mm256_add_ps(t, _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(channels[c] + i), _mm256_set1_ps(origin[c])),
+                                         _mm256_set1_ps(axis[c])));
+    __m256i k = _mm256_cvttps_epi32(_mm256_max_ps(t, _mm256_setzero_ps()));
+    k = _mm256_min_epi32(k, _mm256_set1_epi32(steps));
+    int32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, k);
+    for (int j = 0; j < 8; j++)
+      index[i + j] = (uint8_t)lanes[j];
+  }
+}
+#endif
+
+struct BcKernels
+{
+  const char *name;
+  BcProjectKernel project;
+};
+
+inline const BcKernels &bc_kernels()
+{
+#ifdef MIP_X86
+  static const BcKernels avx2 = {"avx2", bc_project_avx2};
+  static const BcKernels sse2 = {"sse2", bc_project_sse2};
+  static const BcKernels &best = __builtin_cpu_supports("avx2") ? avx2 : sse2;
+  return best;
+#else
+  static const BcKernels scalar = {"scalar", bc_project_scalar};
+  return scalar;
+#endif
+}
+
+// Texels past the edge of the level repeat the last row/column
+inline void bc_fetch_block(const unsigned char *rgba, int width, int height, int bx, int by, BcBlock &block)
+{
+  for (int y = 0; y < 4; y++)
+    for (int x = 0; x < 4; x++)
+    {
+      const unsigned char *texel = rgba + ((size_t)std::min(by * 4 + y, height - 1) * width +
+                                           std::min(bx * 4 + x, width - 1)) * 4;
+      int i = y * 4 + x;
+      block.r[i] = texel[0];
+      block.g[i] = texel[1];
+      block.b[i] = texel[2];
+      block.a[i] = texel[3];
+    }
+}
+
+// Principal axis of the texels (over the first 'channels' channels) by
+// power iteration on their covariance; returns the mean and the axis
+inline void bc_principal_axis(const BcBlock &block, int channels, float mean[4], float axis[4])
+{
+  const float *c[4] = {block.r, block.g, block.b, block.a};
+  for (int j = 0; j < 4; j++)
+  {
+    mean[j] = 0.0f;
+    for (int i = 0; j < channels && i < 16; i++)
+      mean[j] += c[j][i] / 16.0f;
+  }
+  float cov[4][4] = {};
+  for (int i = 0; i < 16; i++)
+    for (int j = 0; j < channels; j++)
+      for (int k = 0; k < channels; k++)
+        cov[j][k] += (c[j][i] - mean[j]) * (c[k][i] - mean[k]);
+
+  float v[4] = {1.0f, 1.0f, 1.0f, channels == 4 ? 1.0f : 0.0f};
+  for (int iteration = 0; iteration < 8; iteration++)
+  {
+    float w[4] = {}, length = 0.0f;
+    for (int j = 0; j < channels; j++)
+    {
+      for (int k = 0; k < channels; k++)
+        w[j] += cov[j][k] * v[k];
+      length = std::max(length, fabsf(w[j]));
+    }
+    if (length < 1e-6f)
+      break;
+    for (int j = 0; j < 4; j++)
+      v[j] = w[j] / length;
+  }
+  float length = sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2] + v[3] * v[3]);
+  for (int j = 0; j < 4; j++)
+    axis[j] = v[j] / length;
+}
+
+// Extent of the texels along the axis, as two points on it
+inline void bc_fit_line(const BcBlock &block, const float mean[4], const float axis[4], float e0[4], float e1[4])
+{
+  float low = 1e9f, high = -1e9f;
+  for (int i = 0; i < 16; i++)
+  {
+    float t = (block.r[i] - mean[0]) * axis[0] + (block.g[i] - mean[1]) * axis[1] +
+              (block.b[i] - mean[2]) * axis[2] + (block.a[i] - mean[3]) * axis[3];
+    low = std::min(low, t);
+    high = std::max(high, t);
+  }
+  for (int j = 0; j < 4; j++)
+  {
+    e0[j] = std::min(std::max(mean[j] + axis[j] * low, 0.0f), 255.0f);
+    e1[j] = std::min(std::max(mean[j] + axis[j] * high, 0.0f), 255.0f);
+  }
+}
+
+// Indices of the texels on the segment from e0 (0) to e1 (steps)
+inline void bc_indices(const BcBlock &block, const float e0[4], const float e1[4], int steps, uint8_t index[16])
+{
+  float d[4], length2 = 0.0f;
+  for (int j = 0; j < 4; j++)
+  {
+    d[j] = e1[j] - e0[j];
+    length2 += d[j] * d[j];
+  }
+  if (length2 < 1e-6f)
+  {
+    memset(index, 0, 16);
+    return;
+  }
+  for (int j = 0; j < 4; j++)
+    d[j] *= steps / length2;
+  bc_kernels().project(block, e0, d, steps, index);
+}
+
+// ---- Block encoders ----
+
+inline uint16_t bc_pack565(const float c[4])
+{
+  int r = (int)(c[0] * 31.0f / 255.0f + 0.5f), g = (int)(c[1] * 63.0f / 255.0f + 0.5f),
+      b = (int)(c[2] * 31.0f / 255.0f + 0.5f);
+  return (uint16_t)(r << 11 | g << 5 | b);
+}
+
+inline void bc_unpack565(uint16_t v, float c[4])
+{
+  int r = v >> 11, g = (v >> 5) & 63, b = v & 31;
+  c[0] = (float)(r << 3 | r >> 2);
+  c[1] = (float)(g << 2 | g >> 4);
+  c[2] = (float)(b << 3 | b >> 2);
+  c[3] = 0.0f;
+}
+
+// Four color mode (color0 > color1), alpha ignored
+inline void bc1_encode_block(const BcBlock &block, unsigned char out[8])
+{
+  BcBlock color = block;
+  std::fill(color.a, color.a + 16, 0.0f);
+  float mean[4], axis[4], e0[4], e1[4];
+  bc_principal_axis(color, 3, mean, axis);
+  bc_fit_line(color, mean, axis, e0, e1);
+  // Pull the ends in by 1/16 of the range, usually a better fit of the
+  // palette to the texels in between
+  for (int j = 0; j < 3; j++)
+  {
+    float inset = (e1[j] - e0[j]) / 16.0f;
+    e0[j] += inset;
+    e1[j] -= inset;
+  }
+
+  uint16_t c0 = bc_pack565(e1), c1 = bc_pack565(e0);
+  if (c0 < c1)
+    std::swap(c0, c1);
+  uint32_t bits = 0;
+  if (c0 != c1)
+  {
+    float p0[4], p1[4];
+    bc_unpack565(c0, p0);
+    bc_unpack565(c1, p1);
+    uint8_t index[16];
+    bc_indices(color, p0, p1, 3, index);
+    // Palette order: color0, color1, 2/3 color0 + 1/3 color1, 1/3 color0 + 2/3 color1
+    static const uint8_t code[4] = {0, 2, 3, 1};
+    for (int i = 0; i < 16; i++)
+      bits |= (uint32_t)code[index[i]] << (i * 2);
+  }
+  out[0] = c0 & 0xff;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 0xff;
+  out[3] = c1 >> 8;
+  for (int i = 0; i < 4; i++)
+    out[4 + i] = (bits >> (i * 8)) & 0xff;
+}
+
+// Eight alpha mode (alpha0 > alpha1)
+inline void bc3_encode_alpha(const BcBlock &block, unsigned char out[8])
+{
+  float low = 255.0f, high = 0.0f;
+  for (int i = 0; i < 16; i++)
+  {
+    low = std::min(low, block.a[i]);
+    high = std::max(high, block.a[i]);
+  }
+  int a0 = (int)(high + 0.5f), a1 = (int)(low + 0.5f);
+  uint64_t bits = 0;
+  if (a0 != a1)
+  {
+    float e0[4] = {0.0f, 0.0f, 0.0f, (float)a1}, e1[4] = {0.0f, 0.0f, 0.0f, (float)a0};
+    BcBlock alpha = {};
+    memcpy(alpha.a, block.a, sizeof(alpha.a));
+    uint8_t index[16];
+    bc_indices(alpha, e0, e1, 7, index);
+    // index 7 is alpha0 (code 0), 0 is alpha1 (code 1), k in between
+    // is code 8 - k
+    for (int i = 0; i < 16; i++)
+    {
+      int k = index[i];
+      uint64_t code = k == 7 ? 0 : k == 0 ? 1 : 8 - k;
+      bits |= code << (i * 3);
+    }
+  }
+  out[0] = (unsigned char)a0;
+  out[1] = (unsigned char)a1;
+  for (int i = 0; i < 6; i++)
+    out[2 + i] = (bits >> (i * 8)) & 0xff;
+}
+
+inline void bc3_encode_block(const BcBlock &block, unsigned char out[16])
+{
+  bc3_encode_alpha(block, out);
+  bc1_encode_block(block, out + 8);
+}
+
+// Little-endian bit writer for the 128-bit BC7 blocks
+struct BcBits
+{
+  unsigned char *out;
+  int position;
+
+  void put(uint32_t value, int count)
+  {
+    for (int i = 0; i < count; i++, position++)
+      if (value & (1u << i))
+        out[position / 8] |= (unsigned char)(1u << (position % 8));
+  }
+};
+
+// Mode 6: one subset, RGBA endpoints of 7 bits plus a p-bit each, 4-bit
+// indices
+inline void bc7_encode_block(const BcBlock &block, unsigned char out[16])
+{
+  float mean[4], axis[4], e[2][4];
+  bc_principal_axis(block, 4, mean, axis);
+  bc_fit_line(block, mean, axis, e[0], e[1]);
+
+  // The p-bit is the low bit of all four 8-bit channels, pick the best
+  // one for each endpoint
+  int q[2][4], p[2];
+  float decoded[2][4];
+  for (int n = 0; n < 2; n++)
+  {
+    float best = 1e30f;
+    for (int bit = 0; bit < 2; bit++)
+    {
+      int candidate[4];
+      float error = 0.0f;
+      for (int j = 0; j < 4; j++)
+      {
+        candidate[j] = std::min(std::max((int)floorf((e[n][j] - bit) / 2.0f + 0.5f), 0), 127);
+        float d = (candidate[j] << 1 | bit) - e[n][j];
+        error += d * d;
+      }
+      if (error < best)
+      {
+        best = error;
+        p[n] = bit;
+        memcpy(q[n], candidate, sizeof(candidate));
+      }
+    }
+    for (int j = 0; j < 4; j++)
+      decoded[n][j] = (float)(q[n][j] << 1 | p[n]);
+  }
+
+  // The weights of the 16 indices are nearly uniform, so the projection
+  // is a good enough pick
+  uint8_t index[16];
+  bc_indices(block, decoded[0], decoded[1], 15, index);
+  // The top bit of the first index is implicit (zero)
+  if (index[0] >= 8)
+  {
+    std::swap(q[0], q[1]);
+    std::swap(p[0], p[1]);
+    for (int i = 0; i < 16; i++)
+      index[i] = 15 - index[i];
+  }
+
+  memset(out, 0, 16);
+  BcBits bits = {out, 0};
+  bits.put(1u << 6, 7); // mode 6
+  for (int j = 0; j < 4; j++)
+  {
+    bits.put(q[0][j], 7);
+    bits.put(q[1][j], 7);
+  }
+  bits.put(p[0], 1);
+  bits.put(p[1], 1);
+  bits.put(index[0], 3);
+  for (int i = 1; i < 16; i++)
+    bits.put(index[i], 4);
+}
+
+// ---- Images and chains ----
+
+inline void bc_encode_rows(MipFormat format, const unsigned char *rgba, int width, int height, int first_row,
+                           int rows, unsigned char *out)
+{
+  int blocks_x = (width + 3) / 4;
+  size_t block_bytes = format == MIP_FORMAT_BC1 ? 8 : 16;
+  BcBlock block;
+  for (int by = first_row; by < first_row + rows; by++)
+    for (int bx = 0; bx < blocks_x; bx++)
+    {
+      bc_fetch_block(rgba, width, height, bx, by, block);
+      unsigned char *dst = out + ((size_t)by * blocks_x + bx) * block_bytes;
+      if (format == MIP_FORMAT_BC1)
+        bc1_encode_block(block, dst);
+      else if (format == MIP_FORMAT_BC3)
+        bc3_encode_block(block, dst);
+      else
+        bc7_encode_block(block, dst);
+    }
+}
+
+// Encode an RGBA8 chain, every level split in bands of block rows
+inline bool bc_encode_chain(const MipChain &src, MipFormat format, int threads, MipChain &dst)
+{
+  if (src.format != MIP_FORMAT_RGBA8 || format == MIP_FORMAT_RGBA8)
+    return false;
+  dst.width = src.width;
+  dst.height = src.height;
+  dst.levels = src.levels;
+  dst.filter = src.filter;
+  dst.srgb = src.srgb;
+  dst.format = format;
+  mip_layout(dst);
+
+  for (int level = 0; level < src.levels; level++)
+  {
+    int width = mip_level_size(src.width, level), height = mip_level_size(src.height, level);
+    int block_rows = (height + 3) / 4;
+    int bands = std::max(1, std::min(threads, block_rows));
+    std::vector<std::thread> workers;
+    for (int band = 0; band < bands; band++)
+    {
+      int first = block_rows * band / bands, last = block_rows * (band + 1) / bands;
+      workers.push_back(std::thread(bc_encode_rows, format, &src.data[src.offsets[level]], width, height, first,
+                                    last - first, &dst.data[dst.offsets[level]]));
+    }
+    for (size_t i = 0; i < workers.size(); i++)
+      workers[i].join();
+  }
+  return true;
+}
+
+// ---- .dds files ----
+
+struct DdsPixelFormat
+{
+  uint32_t size, flags, four_cc, rgb_bit_count;
+  uint32_t r_mask, g_mask, b_mask, a_mask;
+};
+
+struct DdsHeader
+{
+  uint32_t size, flags, height, width, pitch_or_linear_size, depth, mip_map_count;
+  uint32_t reserved1[11];
+  DdsPixelFormat format;
+  uint32_t caps, caps2, caps3, caps4, reserved2;
+};
+
+struct DdsHeaderDx10
+{
+  uint32_t dxgi_format, resource_dimension, misc_flag, array_size, misc_flags2;
+};
+
+const uint32_t dds_fourcc_dxt1 = 0x31545844, dds_fourcc_dxt5 = 0x35545844, dds_fourcc_dx10 = 0x30315844;
+const uint32_t dxgi_format_bc7_unorm = 98;
+
+inline std::string bc_dds_path(const char *image_path)
+{
+  return std::string(image_path) + ".dds";
+}
+
+inline bool bc_save_dds(const char *path, const MipChain &chain)
+{
+  if (chain.format == MIP_FORMAT_RGBA8)
+    return false;
+  DdsHeader header = {};
+  header.size = sizeof(DdsHeader);
+  header.flags = 0x1 | 0x2 | 0x4 | 0x1000 | 0x20000 | 0x80000; // caps, height, width, format, mipmaps, linear size
+  header.height = chain.height;
+  header.width = chain.width;
+  header.pitch_or_linear_size = (uint32_t)mip_level_bytes(chain.format, chain.width, chain.height);
+  header.mip_map_count = chain.levels;
+  header.format.size = sizeof(DdsPixelFormat);
+  header.format.flags = 0x4; // four_cc
+  header.format.four_cc = chain.format == MIP_FORMAT_BC1 ? dds_fourcc_dxt1 :
+                          chain.format == MIP_FORMAT_BC3 ? dds_fourcc_dxt5 : dds_fourcc_dx10;
+  header.caps = 0x8 | 0x1000 | 0x400000; // complex, texture, mipmap
+  DdsHeaderDx10 dx10 = {dxgi_format_bc7_unorm, 3, 0, 1, 0}; // 2D texture
+
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+  bool ok = fwrite("DDS ", 4, 1, file) == 1 && fwrite(&header, sizeof(header), 1, file) == 1 &&
+            (chain.format != MIP_FORMAT_BC7 || fwrite(&dx10, sizeof(dx10), 1, file) == 1) &&
+            fwrite(chain.data.data(), 1, chain.data.size(), file) == chain.data.size();
+  return fclose(file) == 0 && ok;
+}
+
+// Only the block compressed 2D textures written by bc_save_dds, with a
+// full mip chain
+inline bool bc_load_dds(const char *path, MipChain &chain)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+  char magic[4];
+  DdsHeader header;
+  bool ok = fread(magic, 4, 1, file) == 1 && !memcmp(magic, "DDS ", 4) && fread(&header, sizeof(header), 1, file) == 1 &&
+            header.size == sizeof(DdsHeader) && header.width > 0 && header.height > 0 && header.width <= 65536 &&
+            header.height <= 65536;
+  if (ok)
+  {
+    chain.format = NUM_MIP_FORMATS;
+    if (header.format.four_cc == dds_fourcc_dxt1)
+      chain.format = MIP_FORMAT_BC1;
+    else if (header.format.four_cc == dds_fourcc_dxt5)
+      chain.format = MIP_FORMAT_BC3;
+    else if (header.format.four_cc == dds_fourcc_dx10)
+    {
+      DdsHeaderDx10 dx10;
+      if (fread(&dx10, sizeof(dx10), 1, file) == 1 && dx10.dxgi_format == dxgi_format_bc7_unorm)
+        chain.format = MIP_FORMAT_BC7;
+    }
+    chain.width = header.width;
+    chain.height = header.height;
+    chain.levels = mip_level_count(chain.width, chain.height);
+    ok = chain.format != NUM_MIP_FORMATS && (int)header.mip_map_count == chain.levels;
+  }
+  if (ok)
+  {
+    mip_layout(chain);
+    ok = fread(chain.data.data(), 1, chain.data.size(), file) == chain.data.size();
+  }
+  fclose(file);
+  return ok;
+}
+
+#endif
@@ -0,0 +1,282 @@
+// Frame capture: every frame is read back with glReadPixels into one of a
+// ring of pixel pack buffers, which only queues the copy, followed by a
+// fence. A frame is mapped two frames later, when its fence has long
+// signaled, so the readback of frame N completes while N + 1 and N + 2
+// render. The pixels are handed to an encoder thread that writes them as
+// <dir>/frame_NNNNN.png (zlib) or .ppm. The encoder queue is bounded; when
+// it's full the GL thread waits. Frames are only dropped when their fence
+// doesn't signal within a second or their buffer can't be mapped
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <GL/glew.h>
+#include <zlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "glstate.h"
+
+const int capture_ring = 3;
+const int capture_max_queued = 16;
+
+struct CaptureFrame
+{
+  long number;
+  int width, height;
+  std::vector<unsigned char> pixels; // RGBA rows, bottom to top
+};
+
+struct FrameCapture
+{
+  bool enabled = false;
+  std::string dir;
+  bool png = true; // or PPM
+  GLuint pbos[capture_ring] = {};
+  GLsizeiptr sizes[capture_ring] = {};
+  GLsync fences[capture_ring] = {};
+  CaptureFrame pending[capture_ring]; // size and number, pixels unused
+  long frames = 0;                    // read back so far
+  std::thread encoder;
+  std::mutex mutex;
+  std::condition_variable queued, dequeued;
+  std::deque<CaptureFrame> queue; // to encode
+  bool quit = false;
+  long written = 0;
+  int fence_waits = 0;   // frames whose fence hadn't signaled when mapped
+  int encoder_waits = 0; // frames that found the encoder queue full
+  int dropped = 0;       // fence not signaled within a second, or no mapping
+};
+
+// The one frame capture
+inline FrameCapture &frame_capture()
+{
+  static FrameCapture capture;
+  return capture;
+}
+
+// PNG chunk: length, type, data and the CRC of the last two
+inline void png_chunk(FILE *file, const char *type, const unsigned char *data, uint32_t length)
+{
+  unsigned char header[8] = {(unsigned char)(length >> 24), (unsigned char)(length >> 16),
+                             (unsigned char)(length >> 8), (unsigned char)length};
+  memcpy(header + 4, type, 4);
+  uLong crc = crc32(crc32(0, NULL, 0), header + 4, 4);
+  if (length)
+    crc = crc32(crc, data, length); // crc32() of NULL is the initial value, not crc
+  unsigned char footer[4] = {(unsigned char)(crc >> 24), (unsigned char)(crc >> 16), (unsigned char)(crc >> 8),
+                             (unsigned char)crc};
+  fwrite(header, 1, 8, file);
+  if (length)
+    fwrite(data, 1, length, file);
+  fwrite(footer, 1, 4, file);
+}
+
+// 8-bit RGB, every row with the Sub filter, fast zlib level: the frames
+// are big and there are many of them
+inline bool write_png(const char *path, const CaptureFrame &frame)
+{
+  size_t stride = frame.width * 3 + 1;
+  std::vector<unsigned char> rows(stride * frame.height);
+  for (int y = 0; y < frame.height; y++)
+  {
+    const unsigned char *src = &frame.pixels[(size_t)(frame.height - 1 - y) * frame.width * 4];
+    unsigned char *dst = &rows[y * stride];
+    dst[0] = 1; // Sub
+    for (int x = 0; x < frame.width; x++)
+      for (int c = 0; c < 3; c++)
+        dst[1 + x * 3 + c] = src[x * 4 + c] - (x ? src[(x - 1) * 4 + c] : 0);
+  }
+  uLongf compressed_size = compressBound(rows.size());
+  std::vector<unsigned char> compressed(compressed_size);
+  if (compress2(compressed.data(), &compressed_size, rows.data(), rows.size(), 1) != Z_OK)
+    return false;
+
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+  const unsigned char signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  unsigned char ihdr[13] = {(unsigned char)(frame.width >> 24), (unsigned char)(frame.width >> 16),
+                            (unsigned char)(frame.width >> 8), (unsigned char)frame.width,
+                            (unsigned char)(frame.height >> 24), (unsigned char)(frame.height >> 16),
+                            (unsigned char)(frame.height >> 8), (unsigned char)frame.height,
+                            8, 2, 0, 0, 0}; // 8 bits, RGB, deflate, adaptive filters, no interlace
+  fwrite(signature, 1, 8, file);
+  png_chunk(file, "IHDR", ihdr, 13);
+  png_chunk(file, "IDAT", compressed.data(), (uint32_t)compressed_size);
+  png_chunk(file, "IEND", NULL, 0);
+  return fclose(file) == 0;
+}
+
+inline bool write_ppm(const char *path, const CaptureFrame &frame)
+{
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+  fprintf(file, "P6\n%d %d\n255\n", frame.width, frame.height);
+  std::vector<unsigned char> row(frame.width * 3);
+  for (int y = frame.height - 1; y >= 0; y--)
+  {
+    const unsigned char *src = &frame.pixels[(size_t)y * frame.width * 4];
+    for (int x = 0; x < frame.width; x++)
+      for (int c = 0; c < 3; c++)
+        row[x * 3 + c] = src[x * 4 + c];
+    fwrite(row.data(), 1, row.size(), file);
+  }
+  return fclose(file) == 0;
+}
+
+inline void capture_encoder()
+{
+  FrameCapture &capture = frame_capture();
+  std::unique_lock<std::mutex> lock(capture.mutex);
+  for (;;)
+  {
+    capture.queued.wait(lock, [&] { return capture.quit || !capture.queue.empty(); });
+    if (capture.queue.empty())
+      return; // quitting, and everything written
+    CaptureFrame frame = std::move(capture.queue.front());
+    capture.queue.pop_front();
+    lock.unlock();
+    capture.dequeued.notify_one();
+
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/frame_%05ld.%s", capture.dir.c_str(), frame.number, capture.png ? "png" : "ppm");
+    if (!(capture.png ? write_png(path, frame) : write_ppm(path, frame)))
+      fprintf(stderr, "ERROR: could not write %s\n", path);
+    lock.lock();
+    capture.written++;
+  }
+}
+
+inline bool capture_start(const char *dir, const char *format)
+{
+  FrameCapture &capture = frame_capture();
+  if (strcmp(format, "png") && strcmp(format, "ppm"))
+  {
+    fprintf(stderr, "ERROR: unknown capture format %s\n", format);
+    return false;
+  }
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+  {
+    fprintf(stderr, "ERROR: could not create %s\n", dir);
+    return false;
+  }
+  capture.dir = dir;
+  capture.png = !strcmp(format, "png");
+  glGenBuffers(capture_ring, capture.pbos);
+  capture.quit = false;
+  capture.encoder = std::thread(capture_encoder);
+  capture.enabled = true;
+  printf("Capturing frames to %s/frame_NNNNN.%s\n", dir, format);
+  return true;
+}
+
+// Map the pack buffer of a frame read back earlier and queue its pixels
+inline void capture_retire(int slot)
+{
+  FrameCapture &capture = frame_capture();
+  if (!capture.fences[slot])
+    return;
+  GLenum status = glClientWaitSync(capture.fences[slot], 0, 0);
+  if (status == GL_TIMEOUT_EXPIRED)
+  {
+    capture.fence_waits++;
+    status = glClientWaitSync(capture.fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+  }
+  glDeleteSync(capture.fences[slot]);
+  capture.fences[slot] = 0;
+
+  CaptureFrame frame = capture.pending[slot];
+  if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+  {
+    fprintf(stderr, "ERROR: capture of frame %ld not finished (0x%x), dropped\n", frame.number, status);
+    capture.dropped++;
+    return;
+  }
+  frame.pixels.resize(capture.sizes[slot]);
+  gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, capture.pbos[slot]);
+  void *mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, capture.sizes[slot], GL_MAP_READ_BIT);
+  if (mapped)
+  {
+    memcpy(frame.pixels.data(), mapped, capture.sizes[slot]);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  // Left bound, glReadPixels into client memory would write to it
+  gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+  if (!mapped)
+  {
+    fprintf(stderr, "ERROR: could not map capture buffer of frame %ld, dropped\n", frame.number);
+    capture.dropped++;
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(capture.mutex);
+  if (capture.queue.size() >= (size_t)capture_max_queued)
+  {
+    capture.encoder_waits++;
+    capture.dequeued.wait(lock, [&] { return capture.queue.size() < (size_t)capture_max_queued; });
+  }
+  capture.queue.push_back(std::move(frame));
+  lock.unlock();
+  capture.queued.notify_one();
+}
+
+// After the frame is drawn, before the swap. The slot read back two
+// frames ago is retired first, this frame goes to the one after it
+inline void capture_frame(int width, int height)
+{
+  FrameCapture &capture = frame_capture();
+  long number = capture.frames++;
+  if (number >= capture_ring - 1)
+    capture_retire((number - (capture_ring - 1)) % capture_ring);
+
+  int slot = number % capture_ring;
+  GLsizeiptr size = (GLsizeiptr)width * height * 4;
+  gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, capture.pbos[slot]);
+  if (capture.sizes[slot] != size)
+  {
+    glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+    capture.sizes[slot] = size;
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+  gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+  capture.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  capture.pending[slot].number = number;
+  capture.pending[slot].width = width;
+  capture.pending[slot].height = height;
+}
+
+// On the GL thread: retires the frames still in flight, waits for the
+// encoder to write everything
+inline void capture_shutdown()
+{
+  FrameCapture &capture = frame_capture();
+  if (!capture.enabled)
+    return;
+  for (long number = std::max(0L, capture.frames - (capture_ring - 1)); number < capture.frames; number++)
+    capture_retire(number % capture_ring);
+  gl_state_bind_buffer(GL_PIXEL_PACK_BUFFER, 0);
+  {
+    std::lock_guard<std::mutex> lock(capture.mutex);
+    capture.quit = true;
+  }
+  capture.queued.notify_one();
+  capture.encoder.join();
+  glDeleteBuffers(capture_ring, capture.pbos);
+  capture.enabled = false;
+  printf("Capture: %ld frames written, %d dropped, %d fence waits, %d encoder waits\n", capture.written,
+         capture.dropped, capture.fence_waits, capture.encoder_waits);
+}
+
+#endif
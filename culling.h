@@ -0,0 +1,278 @@
+// Frustum culling of bounding spheres: the six planes of the view frustum
+// are read off the view-projection matrix (Gribb & Hartmann), normalized
+// and facing inwards, and a sphere is visible unless it's entirely behind
+// one of them. Conservative: a sphere near a corner of the frustum can be
+// outside of it and still pass.
+//
+// Every object is a local bounding sphere placed by its model matrix
+// (column-major, 16 floats, rigid: its radius isn't scaled). The SSE2
+// and AVX2 kernels test 4 and 8 objects at once, loading the columns of
+// their matrices transposed, and append the indices of the visible ones
+// to a compacted list; AVX2 stores the 8 candidates at once, the set
+// lanes of the visibility mask first (from a table indexed by it), and
+// moves on by its popcount. Picked at runtime on x86
+
+#ifndef CULLING_H
+#define CULLING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CULL_X86 1
+#endif
+
+const int frustum_planes = 6; // left, right, bottom, top, near, far
+
+// Plane p: a[p] x + b[p] y + c[p] z + d[p] >= 0 inside
+struct Frustum
+{
+  float a[frustum_planes], b[frustum_planes], c[frustum_planes], d[frustum_planes];
+};
+
+struct BoundingSphere
+{
+  float x, y, z; // center
+  float radius;
+};
+
+// Planes of a column-major view-projection matrix: the clip-space tests
+// -w <= x <= w... are row 3 plus or minus rows 0, 1, 2
+inline Frustum frustum_from_matrix(const float *m)
+{
+  Frustum frustum;
+  for (int p = 0; p < frustum_planes; p++)
+  {
+    int row = p / 2;
+    float sign = p % 2 ? -1.0f : 1.0f;
+    float a = m[3] + sign * m[row];
+    float b = m[7] + sign * m[4 + row];
+    float c = m[11] + sign * m[8 + row];
+    float d = m[15] + sign * m[12 + row];
+    float length = sqrtf(a * a + b * b + c * c);
+    frustum.a[p] = a / length;
+    frustum.b[p] = b / length;
+    frustum.c[p] = c / length;
+    frustum.d[p] = d / length;
+  }
+  return frustum;
+}
+
+// Smallest sphere around the box of count points, stride floats apart
+inline BoundingSphere bounding_sphere(const float *points, size_t count, size_t stride)
+{
+  BoundingSphere sphere = {0.0f, 0.0f, 0.0f, 0.0f};
+  if (!count)
+    return sphere;
+  float low[3] = {points[0], points[1], points[2]}, high[3] = {points[0], points[1], points[2]};
+  for (size_t i = 1; i < count; i++)
+    for (int k = 0; k < 3; k++)
+    {
+      low[k] = fminf(low[k], points[i * stride + k]);
+      high[k] = fmaxf(high[k], points[i * stride + k]);
+    }
+  sphere.x = (low[0] + high[0]) * 0.5f;
+  sphere.y = (low[1] + high[1]) * 0.5f;
+  sphere.z = (low[2] + high[2]) * 0.5f;
+  float radius2 = 0.0f;
+  for (size_t i = 0; i < count; i++)
+  {
+    float dx = points[i * stride] - sphere.x, dy = points[i * stride + 1] - sphere.y,
+          dz = points[i * stride + 2] - sphere.z;
+    radius2 = fmaxf(radius2, dx * dx + dy * dy + dz * dz);
+  }
+  sphere.radius = sqrtf(radius2);
+  return sphere;
+}
+
+// Test the count objects whose matrices start at models, numbered from
+// first, appending the visible ones to visible. Returns how many
+typedef size_t (*CullKernel)(const Frustum &frustum, const BoundingSphere &bounds, const float *models,
+                             size_t count, uint32_t first, uint32_t *visible);
+
+// ---- Kernels ----
+
+inline size_t cull_spheres_scalar(const Frustum &frustum, const BoundingSphere &bounds, const float *models,
+                                  size_t count, uint32_t first, uint32_t *visible)
+{
+  size_t num_visible = 0;
+  for (size_t n = 0; n < count; n++)
+  {
+    const float *m = models + n * 16;
+    float x = m[0] * bounds.x + m[4] * bounds.y + m[8] * bounds.z + m[12];
+    float y = m[1] * bounds.x + m[5] * bounds.y + m[9] * bounds.z + m[13];
+    float z = m[2] * bounds.x + m[6] * bounds.y + m[10] * bounds.z + m[14];
+    bool inside = true;
+    for (int p = 0; p < frustum_planes && inside; p++)
+      inside = frustum.a[p] * x + frustum.b[p] * y + frustum.c[p] * z + frustum.d[p] >= -bounds.radius;
+    if (inside)
+      visible[num_visible++] = first + (uint32_t)n;
+  }
+  return num_visible;
+}
+
+#ifdef CULL_X86
+// x, y, z of one column (the 4 floats at offset) of 4 matrices
+__attribute__((target("sse2"))) inline void cull_load_column_sse2(const float *models, int offset, __m128 &x,
+                                                                  __m128 &y, __m128 &z)
+{
+  __m128 c0 = _mm_loadu_ps(models + offset), c1 = _mm_loadu_ps(models + 16 + offset);
+  __m128 c2 = _mm_loadu_ps(models + 32 + offset), c3 = _mm_loadu_ps(models + 48 + offset);
+  _MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+  x = c0;
+  y = c1;
+  z = c2;
+}
+
+__attribute__((target("sse2"))) inline size_t cull_spheres_sse2(const Frustum &frustum, const BoundingSphere &bounds,
+                                                                const float *models, size_t count, uint32_t first,
+                                                                uint32_t *visible)
+{
+  const __m128 neg_radius = _mm_set1_ps(-bounds.radius);
+  const float center[3] = {bounds.x, bounds.y, bounds.z};
+  const bool centered = bounds.x == 0.0f && bounds.y == 0.0f && bounds.z == 0.0f;
+  size_t num_visible = 0;
+  size_t n = 0;
+  for (; n + 4 <= count; n += 4)
+  {
+    const float *m = models + n * 16;
+    __m128 x, y, z;
+    cull_load_column_sse2(m, 12, x, y, z);
+    if (!centered)
+    {
+      for (int column = 0; column < 3; column++)
+      {
+        __m128 cx, cy, cz, s = _mm_set1_ps(center[column]);
+        cull_load_column_sse2(m, column * 4, cx, cy, cz);
+        x = _mm_add_ps(x, _mm_mul_ps(cx, s));
+        y = _mm_add_ps(y, _mm_mul_ps(cy, s));
+        z = _mm_add_ps(z, _mm_mul_ps(cz, s));
+      }
+    }
+
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int p = 0; p < frustum_planes; p++)
+    {
+      __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(frustum.a[p])),
+                                              _mm_mul_ps(y, _mm_set1_ps(frustum.b[p]))),
+                                   _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(frustum.c[p])), _mm_set1_ps(frustum.d[p])));
+      inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, neg_radius));
+    }
+    for (int mask = _mm_movemask_ps(inside); mask; mask &= mask - 1)
+      visible[num_visible++] = first + (uint32_t)(n + __builtin_ctz(mask));
+  }
+  return num_visible + cull_spheres_scalar(frustum, bounds, models + n * 16, count - n, first + (uint32_t)n,
+                                           visible + num_visible);
+}
+
+// The set lanes of every 8-bit mask, in order, one per byte
+struct CullCompactTable
+{
+  uint64_t lanes[256];
+
+  CullCompactTable()
+  {
+    for (int mask = 0; mask < 256; mask++)
+    {
+      lanes[mask] = 0;
+      int n = 0;
+      for (int lane = 0; lane < 8; lane++)
+        if (mask & 1 << lane)
+          lanes[mask] |= (uint64_t)lane << (n++ * 8);
+    }
+  }
+};
+
+// As cull_load_column_sse2, for 8 matrices: instances 0..3 in the low
+// 128-bit lane and 4..7 in the high one
+__attribute__((target("avx2"))) inline void cull_load_column_avx2(const float *models, int offset, __m256 &x,
+                                                                  __m256 &y, __m256 &z)
+{
+  models += offset;
+  __m256 c0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(models)), _mm_loadu_ps(models + 64), 1);
+  __m256 c1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(models + 16)), _mm_loadu_ps(models + 80), 1);
+  __m256 c2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(models + 32)), _mm_loadu_ps(models + 96), 1);
+  __m256 c3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(models + 48)), _mm_loadu_ps(models + 112), 1);
+  __m256 t0 = _mm256_unpacklo_ps(c0, c1), t1 = _mm256_unpackhi_ps(c0, c1);
+  __m256 t2 = _mm256_unpacklo_ps(c2, c3), t3 = _mm256_unpackhi_ps(c2, c3);
+  x = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+  y = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+  z = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+}
+
+// Every batch stores 8 indices; the ones past its visible objects are
+// overwritten by the next batch, and never go past the count-th index
+__attribute__((target("avx2,fma,popcnt"))) inline size_t cull_spheres_avx2(const Frustum &frustum,
+                                                                           const BoundingSphere &bounds,
+                                                                           const float *models, size_t count,
+                                                                           uint32_t first, uint32_t *visible)
+{
+  static const CullCompactTable table;
+  const float center[3] = {bounds.x, bounds.y, bounds.z};
+  const __m256 neg_radius = _mm256_set1_ps(-bounds.radius);
+  const bool centered = bounds.x == 0.0f && bounds.y == 0.0f && bounds.z == 0.0f;
+  __m256 a[frustum_planes], b[frustum_planes], c[frustum_planes], d[frustum_planes];
+  for (int p = 0; p < frustum_planes; p++)
+  {
+    a[p] = _mm256_set1_ps(frustum.a[p]);
+    b[p] = _mm256_set1_ps(frustum.b[p]);
+    c[p] = _mm256_set1_ps(frustum.c[p]);
+    d[p] = _mm256_set1_ps(frustum.d[p]);
+  }
+  size_t num_visible = 0;
+  size_t n = 0;
+  for (; n + 8 <= count; n += 8)
+  {
+    const float *m = models + n * 16;
+    __m256 x, y, z;
+    cull_load_column_avx2(m, 12, x, y, z);
+    if (!centered)
+    {
+      for (int column = 0; column < 3; column++)
+      {
+        __m256 cx, cy, cz, s = _mm256_set1_ps(center[column]);
+        cull_load_column_avx2(m, column * 4, cx, cy, cz);
+        x = _mm256_fmadd_ps(cx, s, x);
+        y = _mm256_fmadd_ps(cy, s, y);
+        z = _mm256_fmadd_ps(cz, s, z);
+      }
+    }
+
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (int p = 0; p < frustum_planes; p++)
+    {
+      __m256 distance = _mm256_fmadd_ps(x, a[p], _mm256_fmadd_ps(y, b[p], _mm256_fmadd_ps(z, c[p], d[p])));
+      inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, neg_radius, _CMP_GE_OQ));
+    }
+    int mask = _mm256_movemask_ps(inside);
+    __m256i lanes = _mm256_cvtepu8_epi32(_mm_cvtsi64_si128((long long)table.lanes[mask]));
+    __m256i indices = _mm256_add_epi32(_mm256_set1_epi32((int)(first + n)), lanes);
+    _mm256_storeu_si256((__m256i *)(visible + num_visible), indices);
+    num_visible += _mm_popcnt_u32(mask);
+  }
+  return num_visible + cull_spheres_scalar(frustum, bounds, models + n * 16, count - n, first + (uint32_t)n,
+                                           visible + num_visible);
+}
+#endif
+
+struct CullKernels
+{
+  const char *name;
+  CullKernel spheres;
+};
+
+inline const CullKernels &cull_kernels()
+{
+#ifdef CULL_X86
+  static const CullKernels avx2 = {"avx2", cull_spheres_avx2};
+  static const CullKernels sse2 = {"sse2", cull_spheres_sse2};
+  static const CullKernels &best = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? avx2 : sse2;
+  return best;
+#else
+  static const CullKernels scalar = {"scalar", cull_spheres_scalar};
+  return scalar;
+#endif
+}
+
+#endif
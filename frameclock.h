@@ -0,0 +1,110 @@
+// Frame clocks for reproducible runs, shared by practica_cubo and
+// practica_cubo_osg. The animation time of every frame comes from one of:
+// - wall: seconds since the clock started, different on every run
+// - fixed: the frame number times a fixed step
+// - recorded: the times of a session file, replayed along with the input
+//   of each frame, so a captured session renders the same frames again
+//
+// Session file: a "SESSION1" line, then one line per frame with its time
+// and input (framebuffer size and HUD toggle; the times are printed with
+// %.17g so they read back bit-exact)
+
+#ifndef FRAMECLOCK_H
+#define FRAMECLOCK_H
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <vector>
+
+enum ClockMode
+{
+  CLOCK_WALL,
+  CLOCK_FIXED,
+  CLOCK_RECORDED,
+  NUM_CLOCK_MODES
+};
+
+const char *const clock_mode_names[NUM_CLOCK_MODES] = {"wall", "fixed", "recorded"};
+
+struct SessionFrame
+{
+  double time;
+  int width, height;
+  bool hud;
+};
+
+struct FrameClock
+{
+  ClockMode mode = CLOCK_WALL;
+  double step = 1.0 / 60.0; // fixed
+  std::chrono::steady_clock::time_point start;
+  long frame = 0;                    // frames ticked since the start
+  std::vector<SessionFrame> session; // recorded
+};
+
+inline void clock_start(FrameClock &clock)
+{
+  clock.start = std::chrono::steady_clock::now();
+  clock.frame = 0;
+}
+
+// A recorded clock stops when the session is over
+inline bool clock_finished(const FrameClock &clock)
+{
+  return clock.mode == CLOCK_RECORDED && clock.frame >= (long)clock.session.size();
+}
+
+// Time of the next frame; with a recorded clock, input gets that frame's
+inline double clock_tick(FrameClock &clock, SessionFrame *input = NULL)
+{
+  long frame = clock.frame++;
+  switch (clock.mode)
+  {
+  case CLOCK_FIXED:
+    return frame * clock.step;
+  case CLOCK_RECORDED:
+    if (frame >= (long)clock.session.size())
+      return clock.session.empty() ? 0.0 : clock.session.back().time;
+    if (input)
+      *input = clock.session[frame];
+    return clock.session[frame].time;
+  default:
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - clock.start).count();
+  }
+}
+
+inline FILE *session_create(const char *path)
+{
+  FILE *file = fopen(path, "w");
+  if (file)
+    fprintf(file, "SESSION1\n");
+  return file;
+}
+
+inline void session_write(FILE *file, const SessionFrame &frame)
+{
+  fprintf(file, "%.17g %d %d %d\n", frame.time, frame.width, frame.height, frame.hud ? 1 : 0);
+}
+
+inline bool session_load(const char *path, std::vector<SessionFrame> &frames)
+{
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return false;
+  char magic[16] = "";
+  bool ok = fscanf(file, "%15s", magic) == 1 && !strcmp(magic, "SESSION1");
+  frames.clear();
+  SessionFrame frame;
+  int hud;
+  while (ok && fscanf(file, "%lf %d %d %d", &frame.time, &frame.width, &frame.height, &hud) == 4)
+  {
+    frame.hud = hud != 0;
+    frames.push_back(frame);
+  }
+  ok = ok && feof(file);
+  fclose(file);
+  return ok;
+}
+
+#endif
@@ -0,0 +1,227 @@
+// GL state tracker: shadows the bindings and capabilities changed every
+// frame and skips the calls that would set them to their current value.
+// Code that runs between frames must go through it too, or the shadow
+// copy goes stale. With check set, every call is cross-checked with glGet
+
+#ifndef GLSTATE_H
+#define GLSTATE_H
+
+#include <GL/glew.h>
+#include <stdio.h>
+#include <algorithm>
+
+const GLuint gl_state_unknown = ~0u;
+const int gl_state_texture_units = 16;
+
+struct GlState
+{
+  bool check = false;
+  GLuint program = gl_state_unknown;
+  GLuint vao = gl_state_unknown;
+  GLuint active_texture = gl_state_unknown; // unit index
+  GLuint textures[gl_state_texture_units];  // GL_TEXTURE_2D, per unit
+  GLuint array_buffer = gl_state_unknown;
+  GLuint uniform_buffer = gl_state_unknown;
+  GLuint draw_indirect_buffer = gl_state_unknown;
+  GLuint pixel_unpack_buffer = gl_state_unknown;
+  GLuint pixel_pack_buffer = gl_state_unknown;
+  GLuint draw_framebuffer = gl_state_unknown, read_framebuffer = gl_state_unknown;
+  GLuint depth_test = gl_state_unknown, blend = gl_state_unknown, cull_face = gl_state_unknown;
+  GLuint blend_src = gl_state_unknown, blend_dst = gl_state_unknown;
+  int calls = 0, elided = 0;             // so far this frame
+  int frame_calls = 0, frame_elided = 0; // in the last frame
+  int mismatches = 0;
+
+  GlState() { std::fill(textures, textures + gl_state_texture_units, gl_state_unknown); }
+};
+
+// The one shadow copy, of the context current on the GL thread
+inline GlState &gl_state_shadow()
+{
+  static GlState state;
+  return state;
+}
+
+// Compare the shadow copy with the actual GL state, reporting and
+// adopting whatever differs
+inline void gl_state_check_value(const char *where, const char *what, GLuint &shadow, GLint actual)
+{
+  GlState &gl_state = gl_state_shadow();
+  if (shadow == gl_state_unknown || shadow == (GLuint)actual)
+    return;
+  fprintf(stderr, "ERROR: GL state mismatch after %s: %s is %d, tracked as %u\n", where, what, actual, shadow);
+  gl_state.mismatches++;
+  shadow = (GLuint)actual;
+}
+
+inline void gl_state_check(const char *where)
+{
+  GlState &gl_state = gl_state_shadow();
+  GLint value;
+  glGetIntegerv(GL_CURRENT_PROGRAM, &value);
+  gl_state_check_value(where, "program", gl_state.program, value);
+  glGetIntegerv(GL_VERTEX_ARRAY_BINDING, &value);
+  gl_state_check_value(where, "vertex array", gl_state.vao, value);
+  glGetIntegerv(GL_ARRAY_BUFFER_BINDING, &value);
+  gl_state_check_value(where, "array buffer", gl_state.array_buffer, value);
+  glGetIntegerv(GL_UNIFORM_BUFFER_BINDING, &value);
+  gl_state_check_value(where, "uniform buffer", gl_state.uniform_buffer, value);
+  glGetIntegerv(GL_DRAW_INDIRECT_BUFFER_BINDING, &value);
+  gl_state_check_value(where, "draw indirect buffer", gl_state.draw_indirect_buffer, value);
+  glGetIntegerv(GL_PIXEL_UNPACK_BUFFER_BINDING, &value);
+  gl_state_check_value(where, "pixel unpack buffer", gl_state.pixel_unpack_buffer, value);
+  glGetIntegerv(GL_PIXEL_PACK_BUFFER_BINDING, &value);
+  gl_state_check_value(where, "pixel pack buffer", gl_state.pixel_pack_buffer, value);
+  glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &value);
+  gl_state_check_value(where, "draw framebuffer", gl_state.draw_framebuffer, value);
+  glGetIntegerv(GL_READ_FRAMEBUFFER_BINDING, &value);
+  gl_state_check_value(where, "read framebuffer", gl_state.read_framebuffer, value);
+  gl_state_check_value(where, "depth test", gl_state.depth_test, glIsEnabled(GL_DEPTH_TEST));
+  gl_state_check_value(where, "blend", gl_state.blend, glIsEnabled(GL_BLEND));
+  gl_state_check_value(where, "cull face", gl_state.cull_face, glIsEnabled(GL_CULL_FACE));
+  glGetIntegerv(GL_BLEND_SRC_RGB, &value);
+  gl_state_check_value(where, "blend source", gl_state.blend_src, value);
+  glGetIntegerv(GL_BLEND_DST_RGB, &value);
+  gl_state_check_value(where, "blend destination", gl_state.blend_dst, value);
+
+  GLint active_texture;
+  glGetIntegerv(GL_ACTIVE_TEXTURE, &active_texture);
+  gl_state_check_value(where, "active texture unit", gl_state.active_texture, active_texture - GL_TEXTURE0);
+  for (int unit = 0; unit < gl_state_texture_units; unit++)
+  {
+    if (gl_state.textures[unit] == gl_state_unknown)
+      continue;
+    glActiveTexture(GL_TEXTURE0 + unit);
+    glGetIntegerv(GL_TEXTURE_BINDING_2D, &value);
+    gl_state_check_value(where, "texture binding", gl_state.textures[unit], value);
+  }
+  glActiveTexture(active_texture);
+}
+
+// Update the shadow copy, returning whether the GL call is needed
+inline bool gl_state_set(GLuint &shadow, GLuint value)
+{
+  GlState &gl_state = gl_state_shadow();
+  if (shadow == value)
+  {
+    gl_state.elided++;
+    return false;
+  }
+  shadow = value;
+  gl_state.calls++;
+  return true;
+}
+
+inline void gl_state_use_program(GLuint program)
+{
+  GlState &gl_state = gl_state_shadow();
+  if (!gl_state_set(gl_state.program, program))
+    return;
+  glUseProgram(program);
+  if (gl_state.check)
+    gl_state_check("glUseProgram");
+}
+
+inline void gl_state_bind_vertex_array(GLuint vao)
+{
+  GlState &gl_state = gl_state_shadow();
+  if (!gl_state_set(gl_state.vao, vao))
+    return;
+  glBindVertexArray(vao);
+  if (gl_state.check)
+    gl_state_check("glBindVertexArray");
+}
+
+inline void gl_state_bind_texture(GLuint unit, GLuint texture)
+{
+  GlState &gl_state = gl_state_shadow();
+  if (gl_state.textures[unit] == texture)
+  {
+    gl_state.elided++;
+    return;
+  }
+  if (gl_state_set(gl_state.active_texture, unit))
+    glActiveTexture(GL_TEXTURE0 + unit);
+  gl_state_set(gl_state.textures[unit], texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  if (gl_state.check)
+    gl_state_check("glBindTexture");
+}
+
+inline void gl_state_bind_buffer(GLenum target, GLuint buffer)
+{
+  GlState &gl_state = gl_state_shadow();
+  GLuint *shadow = target == GL_ARRAY_BUFFER ? &gl_state.array_buffer :
+                   target == GL_UNIFORM_BUFFER ? &gl_state.uniform_buffer :
+                   target == GL_DRAW_INDIRECT_BUFFER ? &gl_state.draw_indirect_buffer :
+                   target == GL_PIXEL_UNPACK_BUFFER ? &gl_state.pixel_unpack_buffer :
+                   target == GL_PIXEL_PACK_BUFFER ? &gl_state.pixel_pack_buffer : NULL;
+  if (shadow && !gl_state_set(*shadow, buffer))
+    return;
+  glBindBuffer(target, buffer);
+  if (gl_state.check)
+    gl_state_check("glBindBuffer");
+}
+
+// GL_FRAMEBUFFER binds both the draw and the read framebuffer
+inline void gl_state_bind_framebuffer(GLenum target, GLuint framebuffer)
+{
+  GlState &gl_state = gl_state_shadow();
+  bool draw = target != GL_READ_FRAMEBUFFER, read = target != GL_DRAW_FRAMEBUFFER;
+  if ((!draw || gl_state.draw_framebuffer == framebuffer) && (!read || gl_state.read_framebuffer == framebuffer))
+  {
+    gl_state.elided++;
+    return;
+  }
+  if (draw)
+    gl_state.draw_framebuffer = framebuffer;
+  if (read)
+    gl_state.read_framebuffer = framebuffer;
+  gl_state.calls++;
+  glBindFramebuffer(target, framebuffer);
+  if (gl_state.check)
+    gl_state_check("glBindFramebuffer");
+}
+
+inline void gl_state_enable(GLenum cap, bool enabled)
+{
+  GlState &gl_state = gl_state_shadow();
+  GLuint *shadow = cap == GL_DEPTH_TEST ? &gl_state.depth_test :
+                   cap == GL_BLEND ? &gl_state.blend :
+                   cap == GL_CULL_FACE ? &gl_state.cull_face : NULL;
+  if (shadow && !gl_state_set(*shadow, enabled))
+    return;
+  if (enabled)
+    glEnable(cap);
+  else
+    glDisable(cap);
+  if (gl_state.check)
+    gl_state_check(enabled ? "glEnable" : "glDisable");
+}
+
+inline void gl_state_blend_func(GLenum src, GLenum dst)
+{
+  GlState &gl_state = gl_state_shadow();
+  if (gl_state.blend_src == src && gl_state.blend_dst == dst)
+  {
+    gl_state.elided++;
+    return;
+  }
+  gl_state.blend_src = src;
+  gl_state.blend_dst = dst;
+  gl_state.calls++;
+  glBlendFunc(src, dst);
+  if (gl_state.check)
+    gl_state_check("glBlendFunc");
+}
+
+inline void gl_state_end_frame()
+{
+  GlState &gl_state = gl_state_shadow();
+  gl_state.frame_calls = gl_state.calls;
+  gl_state.frame_elided = gl_state.elided;
+  gl_state.calls = 0;
+  gl_state.elided = 0;
+}
+
+#endif
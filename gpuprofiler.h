@@ -0,0 +1,206 @@
+// GPU profiler: named, nestable scopes timed with GL_TIMESTAMP queries.
+// Each frame uses its own set of query objects from a ring, and their
+// results are read gpu_profiler_latency frames later, when they should be
+// long available, so reading them never stalls the pipeline. Frames whose
+// results are still not ready by then are dropped
+
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+
+#include <GL/glew.h>
+#include <stdio.h>
+#include <vector>
+
+const int gpu_profiler_latency = 4;
+const int gpu_profiler_max_scopes = 32;
+const int gpu_profiler_report_frames = 120; // stdout summary period
+
+struct GpuProfilerFrame
+{
+  GLuint queries[gpu_profiler_max_scopes * 2]; // begin/end timestamps
+  const char *names[gpu_profiler_max_scopes];
+  int depths[gpu_profiler_max_scopes];
+  int num_scopes;
+  long frame;
+  bool pending;
+};
+
+struct GpuProfilerTotal
+{
+  const char *name;
+  int depth;
+  double ms;
+  int count;
+};
+
+struct GpuProfiler
+{
+  bool enabled = false;
+  FILE *log = NULL; // CSV: frame,scope,depth,gpu_ms
+  long frame = 0;
+  int depth = 0;
+  int dropped = 0;
+  int reported_frames = 0;
+  GpuProfilerFrame frames[gpu_profiler_latency];
+  std::vector<GpuProfilerTotal> totals; // since the last report
+};
+
+// The one GPU profiler
+inline GpuProfiler &gpu_profiler_state()
+{
+  static GpuProfiler profiler;
+  return profiler;
+}
+
+inline void gpu_profiler_init(const char *log_path)
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  for (int i = 0; i < gpu_profiler_latency; i++)
+  {
+    glGenQueries(gpu_profiler_max_scopes * 2, gpu_profiler.frames[i].queries);
+    gpu_profiler.frames[i].num_scopes = 0;
+    gpu_profiler.frames[i].pending = false;
+  }
+  if (log_path)
+  {
+    gpu_profiler.log = fopen(log_path, "w");
+    if (gpu_profiler.log)
+      fprintf(gpu_profiler.log, "frame,scope,depth,gpu_ms\n");
+    else
+      fprintf(stderr, "WARNING: could not open GPU profiler log '%s'\n", log_path);
+  }
+}
+
+inline void gpu_profiler_report()
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (!gpu_profiler.reported_frames)
+    return;
+  printf("GPU profile, %d frames (%d dropped):", gpu_profiler.reported_frames, gpu_profiler.dropped);
+  for (size_t i = 0; i < gpu_profiler.totals.size(); i++)
+  {
+    const GpuProfilerTotal &total = gpu_profiler.totals[i];
+    printf("  %*s%s %.3f ms", total.depth * 2, "", total.name, total.ms / gpu_profiler.reported_frames);
+  }
+  printf("\n");
+  gpu_profiler.totals.clear();
+  gpu_profiler.reported_frames = 0;
+  gpu_profiler.dropped = 0;
+}
+
+// Read the results of a past frame, if the GPU is done with it
+inline void gpu_profiler_collect(GpuProfilerFrame &frame, bool wait)
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (!frame.pending)
+    return;
+  frame.pending = false;
+
+  GLuint available = GL_TRUE;
+  if (!wait && frame.num_scopes > 0)
+    glGetQueryObjectuiv(frame.queries[frame.num_scopes * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available)
+  {
+    gpu_profiler.dropped++;
+    return;
+  }
+
+  for (int i = 0; i < frame.num_scopes; i++)
+  {
+    GLuint64 begin, end;
+    glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+    double ms = (end - begin) / 1.0e6;
+    if (gpu_profiler.log)
+      fprintf(gpu_profiler.log, "%ld,%s,%d,%.6f\n", frame.frame, frame.names[i], frame.depths[i], ms);
+
+    // Scopes are matched by name (string literals) and depth
+    size_t t = 0;
+    while (t < gpu_profiler.totals.size() &&
+           (gpu_profiler.totals[t].name != frame.names[i] || gpu_profiler.totals[t].depth != frame.depths[i]))
+      t++;
+    if (t == gpu_profiler.totals.size())
+    {
+      GpuProfilerTotal total = {frame.names[i], frame.depths[i], 0.0, 0};
+      gpu_profiler.totals.push_back(total);
+    }
+    gpu_profiler.totals[t].ms += ms;
+    gpu_profiler.totals[t].count++;
+  }
+
+  if (++gpu_profiler.reported_frames == gpu_profiler_report_frames)
+    gpu_profiler_report();
+}
+
+inline void gpu_profiler_begin_frame()
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (!gpu_profiler.enabled)
+    return;
+  GpuProfilerFrame &frame = gpu_profiler.frames[gpu_profiler.frame % gpu_profiler_latency];
+  gpu_profiler_collect(frame, false);
+  frame.num_scopes = 0;
+  frame.frame = gpu_profiler.frame;
+  gpu_profiler.depth = 0;
+}
+
+inline void gpu_profiler_end_frame()
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (!gpu_profiler.enabled)
+    return;
+  gpu_profiler.frames[gpu_profiler.frame % gpu_profiler_latency].pending = true;
+  gpu_profiler.frame++;
+}
+
+inline int gpu_profiler_begin(const char *name)
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (!gpu_profiler.enabled)
+    return -1;
+  GpuProfilerFrame &frame = gpu_profiler.frames[gpu_profiler.frame % gpu_profiler_latency];
+  if (frame.num_scopes == gpu_profiler_max_scopes)
+    return -1;
+  int scope = frame.num_scopes++;
+  frame.names[scope] = name;
+  frame.depths[scope] = gpu_profiler.depth++;
+  glQueryCounter(frame.queries[scope * 2], GL_TIMESTAMP);
+  return scope;
+}
+
+inline void gpu_profiler_end(int scope)
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (scope < 0)
+    return;
+  GpuProfilerFrame &frame = gpu_profiler.frames[gpu_profiler.frame % gpu_profiler_latency];
+  glQueryCounter(frame.queries[scope * 2 + 1], GL_TIMESTAMP);
+  gpu_profiler.depth--;
+}
+
+// Wait for the frames still in flight and print what's left
+inline void gpu_profiler_shutdown()
+{
+  GpuProfiler &gpu_profiler = gpu_profiler_state();
+  if (!gpu_profiler.enabled)
+    return;
+  for (int i = 1; i <= gpu_profiler_latency; i++)
+    gpu_profiler_collect(gpu_profiler.frames[(gpu_profiler.frame + i) % gpu_profiler_latency], true);
+  gpu_profiler_report();
+  for (int i = 0; i < gpu_profiler_latency; i++)
+    glDeleteQueries(gpu_profiler_max_scopes * 2, gpu_profiler.frames[i].queries);
+  if (gpu_profiler.log)
+    fclose(gpu_profiler.log);
+  gpu_profiler.log = NULL;
+  gpu_profiler.enabled = false;
+}
+
+// Times the enclosing C++ scope
+struct GpuScope
+{
+  int scope;
+  GpuScope(const char *name) : scope(gpu_profiler_begin(name)) {}
+  ~GpuScope() { gpu_profiler_end(scope); }
+};
+
+#endif
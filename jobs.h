@@ -0,0 +1,381 @@
+// Job system: a pool of workers, each with its own deque of jobs. A worker
+// pops from the back of its own deque and, when it's empty, steals from
+// the front of the others'. The GL thread is worker 0 and runs jobs
+// while it waits. Jobs come from a per-frame pool, so every job of a frame
+// must be finished before job_begin_frame(). Jobs form a graph:
+// - job_depends() makes a job wait for another one (and its children);
+//   it must be called before the other one is submitted
+// - a job with a grain splits its range in children of at most that many
+//   items when it runs, so the other workers can steal them (parallel-for)
+// Every job records when it ran and on which worker, summed up per name
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef void (*JobFunction)(void *data, size_t first, size_t count);
+
+const int job_pool_size = 4096;
+const int job_max_continuations = 8;
+
+struct Job
+{
+  const char *name;
+  JobFunction function;
+  void *data;
+  size_t first, count, grain; // item range, split into children when grain > 0
+  Job *parent;
+  std::atomic<int> unfinished; // the job itself and its children
+  std::atomic<int> waiting;    // on dependencies, plus one until submitted
+  Job *continuations[job_max_continuations];
+  int num_continuations;
+  int worker;                      // where it ran
+  double start_ms, run_ms, end_ms; // since job_begin_frame, end includes children
+};
+
+struct JobQueue
+{
+  std::mutex mutex;
+  std::deque<Job *> jobs;
+};
+
+// Per job name, over the frames since job_system_start
+struct JobTotals
+{
+  const char *name;
+  long jobs = 0;        // that ran a function
+  double busy_ms = 0.0; // in their functions, on every worker
+  double span_ms = 0.0; // from the first start to the last end of each frame
+  unsigned workers = 0; // bit mask of the ones that ran them
+};
+
+struct JobSystem
+{
+  std::vector<std::thread> threads;
+  std::vector<JobQueue> queues; // one per worker
+  std::atomic<int> queued{0};
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  std::atomic<bool> quit{false};
+  std::vector<Job> pool;
+  std::atomic<int> num_jobs{0};
+  std::atomic<int> active{0}; // created and not yet finished
+  std::chrono::steady_clock::time_point frame_start;
+  std::vector<JobTotals> totals;
+  long frames = 0;
+};
+
+// The one job system, and the index of the calling thread in it
+inline JobSystem &job_system()
+{
+  static JobSystem jobs;
+  return jobs;
+}
+
+inline int &job_worker_index()
+{
+  static thread_local int index = 0;
+  return index;
+}
+
+inline Job *job_create(const char *name, JobFunction function, void *data, size_t first = 0, size_t count = 0,
+                       size_t grain = 0);
+inline void job_submit(Job *job);
+
+inline double job_clock_ms()
+{
+  JobSystem &jobs = job_system();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - jobs.frame_start).count();
+}
+
+inline void job_push(Job *job)
+{
+  JobSystem &jobs = job_system();
+  JobQueue &queue = jobs.queues[job_worker_index()];
+  {
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    queue.jobs.push_back(job);
+  }
+  {
+    // Under the sleep mutex, or a worker about to sleep could miss it
+    std::lock_guard<std::mutex> lock(jobs.sleep_mutex);
+    jobs.queued++;
+  }
+  jobs.wake.notify_one();
+}
+
+// Own deque first, newest job first; then the oldest job of the others
+inline Job *job_next()
+{
+  JobSystem &jobs = job_system();
+  int n = (int)jobs.queues.size();
+  for (int i = 0; i < n; i++)
+  {
+    JobQueue &queue = jobs.queues[(job_worker_index() + i) % n];
+    std::lock_guard<std::mutex> lock(queue.mutex);
+    if (queue.jobs.empty())
+      continue;
+    Job *job;
+    if (i == 0)
+    {
+      job = queue.jobs.back();
+      queue.jobs.pop_back();
+    }
+    else
+    {
+      job = queue.jobs.front();
+      queue.jobs.pop_front();
+    }
+    jobs.queued--;
+    return job;
+  }
+  return NULL;
+}
+
+inline void job_finish(Job *job)
+{
+  JobSystem &jobs = job_system();
+  if (job->unfinished.fetch_sub(1) != 1)
+    return;
+  job->end_ms = job_clock_ms();
+  for (int i = 0; i < job->num_continuations; i++)
+    job_submit(job->continuations[i]);
+  if (job->parent)
+    job_finish(job->parent);
+  jobs.active--;
+}
+
+inline void job_execute(Job *job)
+{
+  job->worker = job_worker_index();
+  job->start_ms = job_clock_ms();
+  if (job->grain && job->count > job->grain)
+  {
+    // The chunks go to this worker's deque, the others steal them
+    size_t end = job->first + job->count;
+    for (size_t first = job->first; first < end; first += job->grain)
+    {
+      size_t count = std::min(job->grain, end - first);
+      Job *child = job_create(job->name, job->function, job->data, first, count);
+      if (!child)
+      {
+        job->function(job->data, first, count);
+        continue;
+      }
+      child->parent = job;
+      job->unfinished++;
+      job_submit(child);
+    }
+  }
+  else if (job->function)
+    job->function(job->data, job->first, job->count);
+  job->run_ms = job_clock_ms() - job->start_ms;
+  job_finish(job);
+}
+
+inline void job_worker(int index)
+{
+  JobSystem &jobs = job_system();
+  job_worker_index() = index;
+  while (!jobs.quit)
+  {
+    Job *job = job_next();
+    if (job)
+    {
+      job_execute(job);
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(jobs.sleep_mutex);
+    jobs.wake.wait(lock, [&] { return jobs.quit || jobs.queued > 0; });
+  }
+}
+
+inline bool job_system_start(int threads)
+{
+  JobSystem &jobs = job_system();
+  threads = std::min(std::max(threads, 1), 32);
+  jobs.pool = std::vector<Job>(job_pool_size);
+  jobs.queues = std::vector<JobQueue>(threads);
+  jobs.quit = false;
+  jobs.frame_start = std::chrono::steady_clock::now();
+  for (int i = 1; i < threads; i++)
+    jobs.threads.push_back(std::thread(job_worker, i));
+  printf("Job system: %d workers\n", threads);
+  return true;
+}
+
+inline void job_system_shutdown()
+{
+  JobSystem &jobs = job_system();
+  {
+    std::lock_guard<std::mutex> lock(jobs.sleep_mutex);
+    jobs.quit = true;
+  }
+  jobs.wake.notify_all();
+  for (size_t i = 0; i < jobs.threads.size(); i++)
+    jobs.threads[i].join();
+  jobs.threads.clear();
+}
+
+// Run jobs until the ones of this frame are finished, then add their
+// timings to the totals and recycle the pool
+inline void job_collect()
+{
+  JobSystem &jobs = job_system();
+  while (jobs.active > 0)
+  {
+    Job *job = job_next();
+    if (job)
+      job_execute(job);
+    else
+      std::this_thread::yield();
+  }
+
+  int n = jobs.num_jobs;
+  std::vector<JobTotals> frame;
+  std::vector<double> first_start, last_end;
+  for (int i = 0; i < n; i++)
+  {
+    const Job &job = jobs.pool[i];
+    size_t k = 0;
+    while (k < frame.size() && strcmp(frame[k].name, job.name))
+      k++;
+    if (k == frame.size())
+    {
+      JobTotals totals;
+      totals.name = job.name;
+      frame.push_back(totals);
+      first_start.push_back(job.start_ms);
+      last_end.push_back(job.end_ms);
+    }
+    if (!(job.grain && job.count > job.grain))
+    {
+      frame[k].jobs++;
+      frame[k].busy_ms += job.run_ms;
+    }
+    frame[k].workers |= 1u << job.worker;
+    first_start[k] = std::min(first_start[k], job.start_ms);
+    last_end[k] = std::max(last_end[k], job.end_ms);
+  }
+  for (size_t k = 0; k < frame.size(); k++)
+  {
+    size_t t = 0;
+    while (t < jobs.totals.size() && strcmp(jobs.totals[t].name, frame[k].name))
+      t++;
+    if (t == jobs.totals.size())
+    {
+      JobTotals totals;
+      totals.name = frame[k].name;
+      jobs.totals.push_back(totals);
+    }
+    jobs.totals[t].jobs += frame[k].jobs;
+    jobs.totals[t].busy_ms += frame[k].busy_ms;
+    jobs.totals[t].span_ms += last_end[k] - first_start[k];
+    jobs.totals[t].workers |= frame[k].workers;
+  }
+  if (n > 0)
+    jobs.frames++;
+  jobs.num_jobs = 0;
+}
+
+inline void job_begin_frame()
+{
+  JobSystem &jobs = job_system();
+  job_collect();
+  jobs.frame_start = std::chrono::steady_clock::now();
+}
+
+// NULL when the frame's pool is used up
+inline Job *job_create(const char *name, JobFunction function, void *data, size_t first, size_t count,
+                       size_t grain)
+{
+  JobSystem &jobs = job_system();
+  int index = jobs.num_jobs++;
+  if (index >= job_pool_size)
+  {
+    jobs.num_jobs = job_pool_size;
+    return NULL;
+  }
+  Job *job = &jobs.pool[index];
+  job->name = name;
+  job->function = function;
+  job->data = data;
+  job->first = first;
+  job->count = count;
+  job->grain = grain;
+  job->parent = NULL;
+  job->unfinished = 1;
+  job->waiting = 1;
+  job->num_continuations = 0;
+  job->worker = job_worker_index();
+  job->start_ms = job->run_ms = job->end_ms = 0.0;
+  jobs.active++;
+  return job;
+}
+
+// function(data, first, count) over [0, count) in chunks of grain items
+inline Job *job_parallel_for(const char *name, JobFunction function, void *data, size_t count, size_t grain)
+{
+  return job_create(name, function, data, 0, count, std::max<size_t>(grain, 1));
+}
+
+inline void job_depends(Job *job, Job *dependency)
+{
+  if (dependency->num_continuations == job_max_continuations)
+  {
+    fprintf(stderr, "ERROR: job %s has too many dependent jobs\n", dependency->name);
+    return;
+  }
+  dependency->continuations[dependency->num_continuations++] = job;
+  job->waiting++;
+}
+
+// Queued once its dependencies are finished
+inline void job_submit(Job *job)
+{
+  if (job->waiting.fetch_sub(1) == 1)
+    job_push(job);
+}
+
+// Runs other jobs meanwhile, on the calling worker
+inline void job_wait(Job *job)
+{
+  while (job->unfinished > 0)
+  {
+    Job *next = job_next();
+    if (next)
+      job_execute(next);
+    else
+      std::this_thread::yield();
+  }
+}
+
+inline void job_report()
+{
+  JobSystem &jobs = job_system();
+  job_collect();
+  if (!jobs.frames)
+    return;
+  printf("Jobs (per frame, %d workers):\n", (int)jobs.queues.size());
+  for (size_t i = 0; i < jobs.totals.size(); i++)
+  {
+    const JobTotals &totals = jobs.totals[i];
+    int workers = 0;
+    for (unsigned mask = totals.workers; mask; mask &= mask - 1)
+      workers++;
+    printf("  %-12s %6.1f jobs  span %8.3f ms  busy %8.3f ms  on %d workers\n", totals.name,
+           (double)totals.jobs / jobs.frames, totals.span_ms / jobs.frames, totals.busy_ms / jobs.frames, workers);
+  }
+}
+
+#endif
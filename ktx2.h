@@ -0,0 +1,213 @@
+// KTX2 textures: a reader that memory-maps the file, so the levels are
+// uploaded straight from the page cache, and a writer for the chains from
+// mipmap.h and bcenc.h.
+//
+// Only what the loader needs is read: 2D, one face and layer, no
+// supercompression, RGBA8 or BC1/BC3/BC7 (UNORM or SRGB; both are
+// sampled the same way). Written files have the levels from smallest to
+// largest as the format recommends, a basic data format descriptor and a
+// KTXorientation of "ru", since rows are stored bottom to top
+
+#ifndef KTX2_H
+#define KTX2_H
+
+#include "bcenc.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+const unsigned char ktx2_identifier[12] = {0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'};
+
+struct Ktx2Header
+{
+  unsigned char identifier[12];
+  uint32_t vk_format, type_size;
+  uint32_t pixel_width, pixel_height, pixel_depth;
+  uint32_t layer_count, face_count, level_count, supercompression_scheme;
+  uint32_t dfd_byte_offset, dfd_byte_length, kvd_byte_offset, kvd_byte_length;
+  uint64_t sgd_byte_offset, sgd_byte_length;
+};
+
+struct Ktx2Level
+{
+  uint64_t byte_offset, byte_length, uncompressed_byte_length;
+};
+
+// VK_FORMAT_* values, UNORM and SRGB for each MipFormat
+const uint32_t ktx2_vk_formats[NUM_MIP_FORMATS][2] = {{37, 43}, {131, 132}, {137, 138}, {145, 146}};
+
+// An open file: chain has the layout, its offsets into mapping, no data
+struct Ktx2File
+{
+  void *mapping = NULL;
+  size_t size = 0;
+  MipChain chain;
+};
+
+inline std::string ktx2_path(const char *image_path)
+{
+  size_t length = strlen(image_path);
+  if (length > 5 && !strcmp(image_path + length - 5, ".ktx2"))
+    return image_path;
+  return std::string(image_path) + ".ktx2";
+}
+
+inline void ktx2_close(Ktx2File &file)
+{
+  if (file.mapping)
+    munmap(file.mapping, file.size);
+  file.mapping = NULL;
+  file.size = 0;
+}
+
+inline bool ktx2_open(const char *path, Ktx2File &file)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(Ktx2Header))
+  {
+    close(fd);
+    return false;
+  }
+  file.size = st.st_size;
+  file.mapping = mmap(NULL, file.size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (file.mapping == MAP_FAILED)
+  {
+    file.mapping = NULL;
+    return false;
+  }
+
+  const unsigned char *bytes = (const unsigned char *)file.mapping;
+  Ktx2Header header;
+  memcpy(&header, bytes, sizeof(header));
+  MipChain &chain = file.chain;
+  chain.format = NUM_MIP_FORMATS;
+  for (int f = 0; f < NUM_MIP_FORMATS; f++)
+    if (header.vk_format == ktx2_vk_formats[f][0] || header.vk_format == ktx2_vk_formats[f][1])
+    {
+      chain.format = (MipFormat)f;
+      chain.srgb = header.vk_format == ktx2_vk_formats[f][1];
+    }
+  chain.width = header.pixel_width;
+  chain.height = header.pixel_height;
+  chain.levels = std::max(header.level_count, 1u);
+  bool ok = !memcmp(header.identifier, ktx2_identifier, 12) && chain.format != NUM_MIP_FORMATS &&
+            chain.width > 0 && chain.height > 0 && header.pixel_depth == 0 && header.layer_count == 0 &&
+            header.face_count == 1 && header.supercompression_scheme == 0 &&
+            chain.levels <= mip_level_count(chain.width, chain.height) &&
+            sizeof(Ktx2Header) + chain.levels * sizeof(Ktx2Level) <= file.size;
+
+  chain.offsets.resize(chain.levels);
+  for (int level = 0; ok && level < chain.levels; level++)
+  {
+    Ktx2Level index;
+    memcpy(&index, bytes + sizeof(Ktx2Header) + level * sizeof(Ktx2Level), sizeof(index));
+    size_t expected = mip_level_bytes(chain.format, mip_level_size(chain.width, level),
+                                      mip_level_size(chain.height, level));
+    ok = index.byte_length == expected && index.byte_offset <= file.size && expected <= file.size - index.byte_offset;
+    chain.offsets[level] = index.byte_offset;
+  }
+  if (!ok)
+  {
+    ktx2_close(file);
+    return false;
+  }
+  // Start reading the levels in while the upload is still queued
+  madvise(file.mapping, file.size, MADV_WILLNEED);
+  return true;
+}
+
+// Basic data format descriptor of the formats above
+inline std::vector<uint32_t> ktx2_dfd(MipFormat format, bool srgb)
+{
+  // Model, bytes per block and samples (bit offset, bit length, channel)
+  const uint32_t models[NUM_MIP_FORMATS] = {1, 128, 130, 131}; // RGBSDA, BC1A, BC3, BC7
+  const uint32_t alpha_channel = 15, linear = 0x10;
+  std::vector<uint32_t> samples;
+  if (format == MIP_FORMAT_RGBA8)
+    for (uint32_t c = 0; c < 4; c++)
+      samples.push_back(c * 8 | 7 << 16 | (c == 3 ? alpha_channel | (srgb ? linear : 0) : c) << 24);
+  else if (format == MIP_FORMAT_BC3)
+  {
+    samples.push_back(0 | 63 << 16 | (alpha_channel | (srgb ? linear : 0)) << 24);
+    samples.push_back(64 | 63 << 16);
+  }
+  else
+    samples.push_back(0 | (format == MIP_FORMAT_BC1 ? 63 : 127) << 16);
+
+  bool blocks = format != MIP_FORMAT_RGBA8;
+  uint32_t block_bytes = format == MIP_FORMAT_RGBA8 ? 4 : format == MIP_FORMAT_BC1 ? 8 : 16;
+  uint32_t block_size = 24 + 16 * (uint32_t)samples.size();
+  std::vector<uint32_t> dfd;
+  dfd.push_back(4 + block_size);
+  dfd.push_back(0);                                              // Khronos, basic descriptor
+  dfd.push_back(2 | block_size << 16);                           // version 2
+  dfd.push_back(models[format] | 1 << 8 | (srgb ? 2 : 1) << 16); // BT.709 primaries, sRGB/linear
+  dfd.push_back(blocks ? (3 | 3 << 8) : 0);                      // 4x4 or 1x1 texel blocks
+  dfd.push_back(block_bytes);
+  dfd.push_back(0);
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    dfd.push_back(samples[i]);
+    dfd.push_back(0); // sample position
+    dfd.push_back(0); // lower
+    dfd.push_back(blocks ? 0xffffffff : 255);
+  }
+  return dfd;
+}
+
+inline bool ktx2_save(const char *path, const MipChain &chain)
+{
+  std::vector<uint32_t> dfd = ktx2_dfd(chain.format, chain.srgb);
+  const char orientation[] = "KTXorientation\0ru";
+  uint32_t kvd_length = sizeof(orientation);
+  std::vector<unsigned char> kvd(4 + (kvd_length + 3) / 4 * 4);
+  memcpy(&kvd[0], &kvd_length, 4);
+  memcpy(&kvd[4], orientation, kvd_length);
+
+  Ktx2Header header = {};
+  memcpy(header.identifier, ktx2_identifier, 12);
+  header.vk_format = ktx2_vk_formats[chain.format][chain.srgb];
+  header.type_size = 1;
+  header.pixel_width = chain.width;
+  header.pixel_height = chain.height;
+  header.face_count = 1;
+  header.level_count = chain.levels;
+  header.dfd_byte_offset = sizeof(Ktx2Header) + chain.levels * sizeof(Ktx2Level);
+  header.dfd_byte_length = dfd.size() * 4;
+  header.kvd_byte_offset = header.dfd_byte_offset + header.dfd_byte_length;
+  header.kvd_byte_length = kvd.size();
+
+  // Level data aligned to the block size, smallest level first
+  size_t alignment = chain.format == MIP_FORMAT_RGBA8 ? 4 : chain.format == MIP_FORMAT_BC1 ? 8 : 16;
+  size_t position = header.kvd_byte_offset + header.kvd_byte_length;
+  std::vector<Ktx2Level> levels(chain.levels);
+  for (int level = chain.levels - 1; level >= 0; level--)
+  {
+    position = (position + alignment - 1) / alignment * alignment;
+    levels[level].byte_length = levels[level].uncompressed_byte_length =
+        mip_level_bytes(chain.format, mip_level_size(chain.width, level), mip_level_size(chain.height, level));
+    levels[level].byte_offset = position;
+    position += levels[level].byte_length;
+  }
+
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(levels.data(), sizeof(Ktx2Level), levels.size(), file) == levels.size() &&
+            fwrite(dfd.data(), 4, dfd.size(), file) == dfd.size() && fwrite(kvd.data(), 1, kvd.size(), file) == kvd.size();
+  for (int level = chain.levels - 1; ok && level >= 0; level--)
+  {
+    const unsigned char zeros[16] = {};
+    long padding = (long)levels[level].byte_offset - ftell(file);
+    ok = fwrite(zeros, 1, padding, file) == (size_t)padding &&
+         fwrite(&chain.data[chain.offsets[level]], 1, levels[level].byte_length, file) == levels[level].byte_length;
+  }
+  return fclose(file) == 0 && ok;
+}
+
+#endif
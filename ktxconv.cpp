@@ -0,0 +1,106 @@
+// Asset pipeline step: converts any image stb_image reads into a KTX2
+// texture with its full mip chain, raw or block compressed, stored next
+// to it as <image>.ktx2 (or to the given .ktx2 path with --output)
+//
+// Usage: ktxconv [--format rgba8|bc1|bc3|bc7] [--filter box|kaiser|lanczos] [--linear]
+//                [--threads N] [--output file.ktx2] image...
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "ktx2.h"
+
+int main(int argc, char *argv[])
+{
+  MipFormat format = MIP_FORMAT_BC7;
+  MipFilter filter = MIP_FILTER_KAISER;
+  bool srgb = true;
+  int threads = std::max(1u, std::thread::hardware_concurrency());
+  const char *output = NULL;
+  int first_image = 1;
+  for (; first_image < argc && !strncmp(argv[first_image], "--", 2); first_image++)
+  {
+    if (!strcmp(argv[first_image], "--format") && first_image + 1 < argc)
+    {
+      const char *name = argv[++first_image];
+      int f = 0;
+      while (f < NUM_MIP_FORMATS && strcmp(name, mip_format_names[f]))
+        f++;
+      if (f == NUM_MIP_FORMATS)
+      {
+        fprintf(stderr, "ERROR: unknown format %s\n", name);
+        return 1;
+      }
+      format = (MipFormat)f;
+    }
+    else if (!strcmp(argv[first_image], "--filter") && first_image + 1 < argc)
+    {
+      const char *name = argv[++first_image];
+      int f = 0;
+      while (f < NUM_MIP_FILTERS && strcmp(name, mip_filter_names[f]))
+        f++;
+      if (f == NUM_MIP_FILTERS)
+      {
+        fprintf(stderr, "ERROR: unknown filter %s\n", name);
+        return 1;
+      }
+      filter = (MipFilter)f;
+    }
+    else if (!strcmp(argv[first_image], "--linear"))
+      srgb = false;
+    else if (!strcmp(argv[first_image], "--threads") && first_image + 1 < argc)
+      threads = std::max(1, atoi(argv[++first_image]));
+    else if (!strcmp(argv[first_image], "--output") && first_image + 1 < argc)
+      output = argv[++first_image];
+    else
+      break;
+  }
+  if (first_image >= argc || (output && argc - first_image > 1))
+  {
+    fprintf(stderr, "Usage: %s [--format rgba8|bc1|bc3|bc7] [--filter box|kaiser|lanczos] [--linear]\n"
+                    "          [--threads N] [--output file.ktx2] image...\n",
+            argv[0]);
+    return 1;
+  }
+
+  // Same orientation as the textures loaded by practica_cubo
+  stbi_set_flip_vertically_on_load(1);
+
+  int failed = 0;
+  for (int i = first_image; i < argc; i++)
+  {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int width, height, channels;
+    unsigned char *pixels = stbi_load(argv[i], &width, &height, &channels, 4);
+    if (!pixels)
+    {
+      fprintf(stderr, "ERROR: could not load %s\n", argv[i]);
+      failed++;
+      continue;
+    }
+
+    MipChain chain, compressed;
+    mip_generate(pixels, width, height, filter, srgb, chain);
+    stbi_image_free(pixels);
+    if (format != MIP_FORMAT_RGBA8)
+    {
+      bc_encode_chain(chain, format, threads, compressed);
+      std::swap(chain, compressed);
+    }
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::string path = output ? output : ktx2_path(argv[i]);
+    if (!ktx2_save(path.c_str(), chain))
+    {
+      fprintf(stderr, "ERROR: could not write %s\n", path.c_str());
+      failed++;
+      continue;
+    }
+    printf("%s: %dx%d %s, %d levels, %zu bytes in %.2f ms\n", path.c_str(), width, height,
+           mip_format_names[format], chain.levels, chain.data.size(), ms);
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,76 @@
+// Asset pipeline step: builds the full mip chain of each image and stores
+// it next to it as <image>.mips, which practica_cubo uploads as is
+//
+// Usage: mipgen [--filter box|kaiser|lanczos] [--linear] image...
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "mipmap.h"
+
+int main(int argc, char *argv[])
+{
+  MipFilter filter = MIP_FILTER_KAISER;
+  bool srgb = true;
+  int first_image = 1;
+  for (; first_image < argc && !strncmp(argv[first_image], "--", 2); first_image++)
+  {
+    if (!strcmp(argv[first_image], "--filter") && first_image + 1 < argc)
+    {
+      const char *name = argv[++first_image];
+      int f = 0;
+      while (f < NUM_MIP_FILTERS && strcmp(name, mip_filter_names[f]))
+        f++;
+      if (f == NUM_MIP_FILTERS)
+      {
+        fprintf(stderr, "ERROR: unknown filter %s\n", name);
+        return 1;
+      }
+      filter = (MipFilter)f;
+    }
+    else if (!strcmp(argv[first_image], "--linear"))
+      srgb = false;
+    else
+      break;
+  }
+  if (first_image >= argc)
+  {
+    fprintf(stderr, "Usage: %s [--filter box|kaiser|lanczos] [--linear] image...\n", argv[0]);
+    return 1;
+  }
+
+  // Same orientation as the textures loaded by practica_cubo
+  stbi_set_flip_vertically_on_load(1);
+  printf("%s filter, %s kernels\n", mip_filter_names[filter], mip_kernels().name);
+
+  int failed = 0;
+  for (int i = first_image; i < argc; i++)
+  {
+    int width, height, channels;
+    unsigned char *pixels = stbi_load(argv[i], &width, &height, &channels, 4);
+    if (!pixels)
+    {
+      fprintf(stderr, "ERROR: could not load %s\n", argv[i]);
+      failed++;
+      continue;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    MipChain chain;
+    mip_generate(pixels, width, height, filter, srgb, chain);
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    stbi_image_free(pixels);
+
+    std::string path = mip_cache_path(argv[i]);
+    if (!mip_save(path.c_str(), chain))
+    {
+      fprintf(stderr, "ERROR: could not write %s\n", path.c_str());
+      failed++;
+      continue;
+    }
+    printf("%s: %dx%d, %d levels in %.2f ms\n", path.c_str(), width, height, chain.levels, ms);
+  }
+  return failed ? 1 : 0;
+}
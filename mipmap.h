@@ -0,0 +1,451 @@
+// CPU mip chain generation for RGBA8 images, and the .mips files that
+// store a whole chain next to the source image so the runtime only has
+// to upload it.
+//
+// Every level is filtered from the previous one in linear float RGBA
+// (sRGB decoded first when asked to) with a separable 2:1 kernel: box,
+// Kaiser-windowed sinc or Lanczos-3. The inner loops have SSE2 and AVX2
+// versions, picked at runtime on x86.
+//
+// .mips file: a MipFileHeader, then every level as RGBA8 rows, largest
+// first. Rows are stored bottom to top, ready for glTexSubImage2D
+
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MIP_X86 1
+#endif
+
+enum MipFilter
+{
+  MIP_FILTER_BOX,
+  MIP_FILTER_KAISER,
+  MIP_FILTER_LANCZOS,
+  NUM_MIP_FILTERS
+};
+
+const char *const mip_filter_names[NUM_MIP_FILTERS] = {"box", "kaiser", "lanczos"};
+
+// Level layout in memory; the block compressed ones come from bcenc.h
+enum MipFormat
+{
+  MIP_FORMAT_RGBA8,
+  MIP_FORMAT_BC1, // 8 bytes per 4x4 block
+  MIP_FORMAT_BC3, // 16 bytes per 4x4 block
+  MIP_FORMAT_BC7, // 16 bytes per 4x4 block
+  NUM_MIP_FORMATS
+};
+
+struct MipChain
+{
+  int width = 0, height = 0; // level 0
+  int levels = 0;
+  MipFilter filter = MIP_FILTER_BOX;
+  bool srgb = false;
+  MipFormat format = MIP_FORMAT_RGBA8;
+  std::vector<unsigned char> data; // every level
+  std::vector<size_t> offsets;     // of each level in data
+};
+
+struct MipFileHeader
+{
+  char magic[4]; // "MIP1"
+  uint32_t width, height, levels;
+  uint32_t filter, srgb;
+};
+
+inline int mip_level_size(int size, int level)
+{
+  return std::max(1, size >> level);
+}
+
+inline size_t mip_level_bytes(MipFormat format, int width, int height)
+{
+  if (format == MIP_FORMAT_RGBA8)
+    return (size_t)width * height * 4;
+  size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+  return blocks * (format == MIP_FORMAT_BC1 ? 8 : 16);
+}
+
+inline int mip_level_count(int width, int height)
+{
+  int levels = 1;
+  while ((std::max(width, height) >> levels) > 0)
+    levels++;
+  return levels;
+}
+
+// Fill in the offsets of every level and size the data
+inline void mip_layout(MipChain &chain)
+{
+  size_t total = 0;
+  chain.offsets.resize(chain.levels);
+  for (int level = 0; level < chain.levels; level++)
+  {
+    chain.offsets[level] = total;
+    total += mip_level_bytes(chain.format, mip_level_size(chain.width, level), mip_level_size(chain.height, level));
+  }
+  chain.data.resize(total);
+}
+
+// ---- Filter kernels ----
+
+inline float mip_sinc(float x)
+{
+  if (fabsf(x) < 1e-6f)
+    return 1.0f;
+  x *= (float)M_PI;
+  return sinf(x) / x;
+}
+
+// Zeroth order modified Bessel function of the first kind, for the
+// Kaiser window
+inline float mip_bessel_i0(float x)
+{
+  float sum = 1.0f, term = 1.0f;
+  for (int k = 1; k < 20; k++)
+  {
+    term *= (x * 0.5f / k) * (x * 0.5f / k);
+    sum += term;
+  }
+  return sum;
+}
+
+inline float mip_filter_support(MipFilter filter)
+{
+  return filter == MIP_FILTER_BOX ? 0.5f : 3.0f;
+}
+
+inline float mip_filter_weight(MipFilter filter, float x)
+{
+  const float support = mip_filter_support(filter);
+  if (fabsf(x) >= support)
+    return 0.0f;
+  switch (filter)
+  {
+  case MIP_FILTER_BOX:
+    return 1.0f;
+  case MIP_FILTER_KAISER:
+  {
+    const float alpha = 4.0f;
+    float t = x / support;
+    return mip_sinc(x) * mip_bessel_i0(alpha * sqrtf(1.0f - t * t)) / mip_bessel_i0(alpha);
+  }
+  default:
+    return mip_sinc(x) * mip_sinc(x / support);
+  }
+}
+
+// Source indices (clamped to the edges) and normalized weights of every
+// output sample; the same number of taps for all of them
+struct MipTaps
+{
+  int taps;
+  std::vector<int> index;
+  std::vector<float> weight;
+};
+
+inline void mip_compute_taps(MipFilter filter, int src_size, int dst_size, MipTaps &taps)
+{
+  float scale = (float)src_size / dst_size;
+  float radius = mip_filter_support(filter) * scale;
+  taps.taps = (int)ceilf(radius * 2.0f) + 1;
+  taps.index.resize(dst_size * taps.taps);
+  taps.weight.resize(dst_size * taps.taps);
+  for (int i = 0; i < dst_size; i++)
+  {
+    float center = (i + 0.5f) * scale;
+    int first = (int)floorf(center - radius);
+    float total = 0.0f;
+    for (int k = 0; k < taps.taps; k++)
+    {
+      int src = first + k;
+      float w = mip_filter_weight(filter, (src + 0.5f - center) / scale);
+      taps.index[i * taps.taps + k] = std::min(std::max(src, 0), src_size - 1);
+      taps.weight[i * taps.taps + k] = w;
+      total += w;
+    }
+    for (int k = 0; k < taps.taps; k++)
+      taps.weight[i * taps.taps + k] /= total;
+  }
+}
+
+// ---- Inner loops ----
+
+// Vertical pass: dst[i] = sum of weights[k] * rows[k][i], over count floats
+typedef void (*MipRowsKernel)(const float *const *rows, const float *weights, int taps, float *dst, int count);
+// Horizontal pass over RGBA pixels: dst pixel i from the taps of sample i
+typedef void (*MipColumnsKernel)(const float *src, const MipTaps &taps, float *dst, int count);
+
+inline void mip_rows_scalar(const float *const *rows, const float *weights, int taps, float *dst, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    float sum = 0.0f;
+    for (int k = 0; k < taps; k++)
+      sum += weights[k] * rows[k][i];
+    dst[i] = sum;
+  }
+}
+
+inline void mip_columns_scalar(const float *src, const MipTaps &taps, float *dst, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    const int *index = &taps.index[i * taps.taps];
+    const float *weight = &taps.weight[i * taps.taps];
+    for (int c = 0; c < 4; c++)
+    {
+      float sum = 0.0f;
+      for (int k = 0; k < taps.taps; k++)
+        sum += weight[k] * src[index[k] * 4 + c];
+      dst[i * 4 + c] = sum;
+    }
+  }
+}
+
+#ifdef MIP_X86
+__attribute__((target("sse2"))) inline void mip_rows_sse2(const float *const *rows, const float *weights, int taps,
+                                                          float *dst, int count)
+{
+  int i = 0;
+  for (; i + 4 <= count; i += 4)
+  {
+    __m128 sum = _mm_setzero_ps();
+    for (int k = 0; k < taps; k++)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_loadu_ps(rows[k] + i)));
+    _mm_storeu_ps(dst + i, sum);
+  }
+  const float *tail[64];
+  for (int k = 0; k < taps && i < count; k++)
+    tail[k] = rows[k] + i;
+  if (i < count)
+    mip_rows_scalar(tail, weights, taps, dst + i, count - i);
+}
+
+// A pixel is one vector
+__attribute__((target("sse2"))) inline void mip_columns_sse2(const float *src, const MipTaps &taps, float *dst,
+                                                             int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    const int *index = &taps.index[i * taps.taps];
+    const float *weight = &taps.weight[i * taps.taps];
+    __m128 sum = _mm_setzero_ps();
+    for (int k = 0; k < taps.taps; k++)
+      sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weight[k]), _mm_loadu_ps(src + index[k] * 4)));
+    _mm_storeu_ps(dst + i * 4, sum);
+  }
+}
+
+__attribute__((target("avx2"))) inline void mip_rows_avx2(const float *const *rows, const float *weights, int taps,
+                                                          float *dst, int count)
+{
+  int i = 0;
+  for (; i + 8 <= count; i += 8)
+  {
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k < taps; k++)
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_loadu_ps(rows[k] + i)));
+    _mm256_storeu_ps(dst + i, sum);
+  }
+  const float *tail[64];
+  for (int k = 0; k < taps && i < count; k++)
+    tail[k] = rows[k] + i;
+  if (i < count)
+    mip_rows_sse2(tail, weights, taps, dst + i, count - i);
+}
+
+// Two pixels per vector, one per 128-bit lane
+__attribute__((target("avx2"))) inline void mip_columns_avx2(const float *src, const MipTaps &taps, float *dst,
+                                                             int count)
+{
+  int i = 0;
+  for (; i + 2 <= count; i += 2)
+  {
+    const int *index = &taps.index[i * taps.taps];
+    const float *weight = &taps.weight[i * taps.taps];
+    __m256 sum = _mm256_setzero_ps();
+    for (int k = 0; k < taps.taps; k++)
+    {
+      __m256 pixels = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(src + index[k] * 4)),
+                                           _mm_loadu_ps(src + index[taps.taps + k] * 4), 1);
+      __m256 weights = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_set1_ps(weight[k])),
+                                            _mm_set1_ps(weight[taps.taps + k]), 1);
+      sum = _mm256_add_ps(sum, _mm256_mul_ps(weights, pixels));
+    }
+    _mm256_storeu_ps(dst + i * 4, sum);
+  }
+  if (i < count)
+  {
+    MipTaps last;
+    last.taps = taps.taps;
+    last.index.assign(taps.index.begin() + i * taps.taps, taps.index.end());
+    last.weight.assign(taps.weight.begin() + i * taps.taps, taps.weight.end());
+    mip_columns_sse2(src, last, dst + i * 4, count - i);
+  }
+}
+#endif
+
+struct MipKernels
+{
+  const char *name;
+  MipRowsKernel rows;
+  MipColumnsKernel columns;
+};
+
+inline const MipKernels &mip_kernels()
+{
+#ifdef MIP_X86
+  static const MipKernels avx2 = {"avx2", mip_rows_avx2, mip_columns_avx2};
+  static const MipKernels sse2 = {"sse2", mip_rows_sse2, mip_columns_sse2};
+  static const MipKernels &best = __builtin_cpu_supports("avx2") ? avx2 : sse2;
+  return best;
+#else
+  static const MipKernels scalar = {"scalar", mip_rows_scalar, mip_columns_scalar};
+  return scalar;
+#endif
+}
+
+// ---- Chain generation ----
+
+inline float mip_srgb_to_linear(float c)
+{
+  return c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+}
+
+inline float mip_linear_to_srgb(float c)
+{
+  return c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+}
+
+// Halve a linear RGBA float image
+inline void mip_downsample(const std::vector<float> &src, int src_w, int src_h, std::vector<float> &dst, int dst_w,
+                           int dst_h, MipFilter filter)
+{
+  const MipKernels &kernels = mip_kernels();
+  MipTaps horizontal, vertical;
+  mip_compute_taps(filter, src_w, dst_w, horizontal);
+  mip_compute_taps(filter, src_h, dst_h, vertical);
+
+  dst.resize((size_t)dst_w * dst_h * 4);
+  std::vector<float> row(src_w * 4);
+  const float *rows[64];
+  for (int y = 0; y < dst_h; y++)
+  {
+    for (int k = 0; k < vertical.taps; k++)
+      rows[k] = &src[(size_t)vertical.index[y * vertical.taps + k] * src_w * 4];
+    kernels.rows(rows, &vertical.weight[y * vertical.taps], vertical.taps, row.data(), src_w * 4);
+    kernels.columns(row.data(), horizontal, &dst[(size_t)y * dst_w * 4], dst_w);
+  }
+}
+
+// rgba: width * height RGBA8 pixels, as they go into level 0
+inline bool mip_generate(const unsigned char *rgba, int width, int height, MipFilter filter, bool srgb,
+                         MipChain &chain)
+{
+  if (width <= 0 || height <= 0)
+    return false;
+  chain.width = width;
+  chain.height = height;
+  chain.filter = filter;
+  chain.srgb = srgb;
+  chain.format = MIP_FORMAT_RGBA8;
+  chain.levels = mip_level_count(width, height);
+  mip_layout(chain);
+  memcpy(chain.data.data(), rgba, (size_t)width * height * 4);
+
+  float decode[256];
+  for (int i = 0; i < 256; i++)
+    decode[i] = srgb ? mip_srgb_to_linear(i / 255.0f) : i / 255.0f;
+
+  std::vector<float> current((size_t)width * height * 4), next;
+  for (size_t i = 0; i < current.size(); i++)
+    current[i] = (i % 4 == 3) ? rgba[i] / 255.0f : decode[rgba[i]]; // alpha is always linear
+
+  for (int level = 1; level < chain.levels; level++)
+  {
+    int src_w = mip_level_size(width, level - 1), src_h = mip_level_size(height, level - 1);
+    int dst_w = mip_level_size(width, level), dst_h = mip_level_size(height, level);
+    mip_downsample(current, src_w, src_h, next, dst_w, dst_h, filter);
+
+    unsigned char *out = &chain.data[chain.offsets[level]];
+    for (size_t i = 0; i < next.size(); i++)
+    {
+      float c = std::min(std::max(next[i], 0.0f), 1.0f);
+      if (srgb && i % 4 != 3)
+        c = mip_linear_to_srgb(c);
+      out[i] = (unsigned char)(c * 255.0f + 0.5f);
+    }
+    current.swap(next);
+  }
+  return true;
+}
+
+// ---- .mips files ----
+
+inline std::string mip_cache_path(const char *image_path)
+{
+  return std::string(image_path) + ".mips";
+}
+
+// The cache is stale when older than its image
+inline bool mip_cache_fresh(const char *image_path, const char *cache_path)
+{
+  struct stat image, cache;
+  return stat(image_path, &image) == 0 && stat(cache_path, &cache) == 0 && cache.st_mtime >= image.st_mtime;
+}
+
+inline bool mip_save(const char *path, const MipChain &chain)
+{
+  if (chain.format != MIP_FORMAT_RGBA8)
+    return false;
+  FILE *file = fopen(path, "wb");
+  if (!file)
+    return false;
+  MipFileHeader header = {{'M', 'I', 'P', '1'}, (uint32_t)chain.width, (uint32_t)chain.height, (uint32_t)chain.levels,
+                          (uint32_t)chain.filter, chain.srgb};
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(chain.data.data(), 1, chain.data.size(), file) == chain.data.size();
+  return fclose(file) == 0 && ok;
+}
+
+inline bool mip_load(const char *path, MipChain &chain)
+{
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return false;
+  MipFileHeader header;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 && !memcmp(header.magic, "MIP1", 4) &&
+            header.width > 0 && header.height > 0 && header.width <= 65536 && header.height <= 65536 &&
+            header.filter < NUM_MIP_FILTERS;
+  if (ok)
+  {
+    chain.width = header.width;
+    chain.height = header.height;
+    chain.filter = (MipFilter)header.filter;
+    chain.srgb = header.srgb != 0;
+    chain.format = MIP_FORMAT_RGBA8;
+    chain.levels = mip_level_count(chain.width, chain.height);
+    ok = (int)header.levels == chain.levels;
+  }
+  if (ok)
+  {
+    mip_layout(chain);
+    ok = fread(chain.data.data(), 1, chain.data.size(), file) == chain.data.size();
+  }
+  fclose(file);
+  return ok;
+}
+
+#endif
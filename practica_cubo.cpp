@@ -7,7 +7,27 @@
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 // GLM library to deal with matrix operations
 #include <glm/glm.hpp>
@@ -16,47 +36,734 @@
 #include <glm/gtc/type_ptr.hpp>
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "ktx2.h"
+#include "animation.h"
+#include "frameclock.h"
+#include "culling.h"
+#include "glstate.h"
+#include "streambuffer.h"
+#include "capture.h"
+#include "gpuprofiler.h"
+#include "renderqueue.h"
+#include "jobs.h"
 
 int gl_width = 640;
 int gl_height = 480;
 
 void glfw_window_size_callback(GLFWwindow *window, int width, int height);
 void processInput(GLFWwindow *window);
+void update(double);
 void render(double);
+bool create_headless_context();
+void destroy_headless_context();
+void shutdown_all(bool release_gl);
 
-GLuint shader_program = 0;        // shader program to set render pipeline
-GLuint vao = 0;                   // Vertext Array Object to set input data
-GLuint texture = 0;               // Texture to paste on polygon
-GLint mv_location, proj_location; // Uniforms for transformation matrices
+// Frame time statistics (in milliseconds)
+struct FrameStats
+{
+  double min, median, p99, mean;
+};
+
+struct HeadlessStats
+{
+  FrameStats update, cpu, frame, gpu;
+  bool gpu_timed; // false without timer queries
+};
+
+// Per-frame CPU time of every phase of the main loop, kept for a rolling
+// window of frames (for the HUD) and optionally logged as CSV or JSON
+enum FramePhase
+{
+  PHASE_INPUT,
+  PHASE_UPDATE,
+  PHASE_RENDER,
+  PHASE_SWAP,
+  PHASE_POLL,
+  NUM_PHASES
+};
+
+const char *const frame_phase_names[NUM_PHASES] = {"input", "update", "render", "swap", "poll"};
+const int frame_history_size = 240;
+
+struct FrameTimings
+{
+  double phase_ms[NUM_PHASES];
+  double total_ms;
+};
+
+struct FrameRecorder
+{
+  std::chrono::steady_clock::time_point mark;
+  FrameTimings current;
+  FrameTimings history[frame_history_size];
+  long frames = 0;
+  double p50 = 0.0, p95 = 0.0, p99 = 0.0; // of the frame totals in history
+  FILE *log = NULL;
+  bool json = false;
+};
+
+FrameRecorder frame_recorder;
+
+bool frame_log_open(const char *path);
+void frame_log_close();
+void frame_begin();
+void frame_phase(FramePhase phase);
+void frame_end();
+
+FrameStats frame_stats(std::vector<double> samples);
+void print_frame_stats(const char *label, const FrameStats &stats);
+HeadlessStats run_headless(int frames);
+
+// Program reflection: active uniforms and attributes are introspected
+// once after linking, the render path only uses the typed handles
+struct ProgramVariable
+{
+  std::string name;
+  GLint location;
+  GLenum type;
+  GLint size; // array length
+};
+
+struct UniformBlock
+{
+  std::string name;
+  GLuint index;
+  GLint data_size;
+};
+
+struct ShaderProgram
+{
+  GLuint id = 0;
+  std::vector<ProgramVariable> uniforms;
+  std::vector<ProgramVariable> attributes;
+  std::vector<UniformBlock> blocks;
+};
+
+template <GLenum Type>
+struct Uniform
+{
+  GLint location = -1;
+};
+typedef Uniform<GL_FLOAT_MAT4> UniformMat4;
+typedef Uniform<GL_SAMPLER_2D> UniformSampler2D;
+typedef Uniform<GL_BOOL> UniformBool;
+typedef Uniform<GL_FLOAT_VEC4> UniformVec4;
+typedef Uniform<GL_UNSIGNED_INT> UniformUint;
+
+bool build_program(ShaderProgram &program, const char *vertex_source, const char *fragment_source,
+                   const char *const *attributes);
+bool build_compute_program(ShaderProgram &program, const char *source);
+void reflect_program(ShaderProgram &program);
+const ProgramVariable *find_uniform(const ShaderProgram &program, const char *name, GLenum type);
+bool bind_uniform_block(const ShaderProgram &program, const char *name, GLuint binding, GLint data_size);
+
+template <GLenum Type>
+Uniform<Type> get_uniform(const ShaderProgram &program, const char *name)
+{
+  Uniform<Type> uniform;
+  const ProgramVariable *variable = find_uniform(program, name, Type);
+  if (variable)
+    uniform.location = variable->location;
+  return uniform;
+}
+
+inline void set_uniform(UniformMat4 uniform, const glm::mat4 &value)
+{
+  glUniformMatrix4fv(uniform.location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+inline void set_uniform(UniformSampler2D uniform, GLint texture_unit)
+{
+  glUniform1i(uniform.location, texture_unit);
+}
+
+inline void set_uniform(UniformBool uniform, bool value)
+{
+  glUniform1i(uniform.location, value);
+}
+
+inline void set_uniform(UniformVec4 uniform, const glm::vec4 *values, GLsizei count = 1)
+{
+  glUniform4fv(uniform.location, count, glm::value_ptr(values[0]));
+}
+
+inline void set_uniform(UniformUint uniform, GLuint value)
+{
+  glUniform1ui(uniform.location, value);
+}
+
+// Indexed meshes: unique position/UV/normal tuples plus an index buffer
+// reordered for the post-transform vertex cache. Each range is a draw,
+// either of its own or as a command of a multi-draw call
+struct MeshVertex
+{
+  glm::vec3 position;
+  glm::vec2 uv;
+  glm::vec3 normal;
+};
+
+struct MeshRange
+{
+  GLuint first; // first index
+  GLsizei count;
+  GLint base_vertex; // added to the indices, for meshes packed together
+  bool textured;
+};
+
+struct Mesh
+{
+  std::vector<MeshVertex> vertices;
+  std::vector<GLuint> indices;
+  std::vector<MeshRange> ranges;
+};
+
+// Deduplicates vertices while triangles are added to a mesh
+struct MeshBuilder
+{
+  Mesh mesh;
+  std::unordered_map<std::string, GLuint> unique;
+};
+
+void mesh_begin_range(MeshBuilder &builder, bool textured);
+void mesh_add_vertex(MeshBuilder &builder, const MeshVertex &vertex);
+void mesh_optimize(Mesh &mesh);
+void mesh_append(Mesh &pool, const Mesh &mesh);
+float mesh_acmr(const Mesh &mesh, int cache_size);
+bool load_obj(const char *path, MeshBuilder &builder);
+
+// Frame time HUD: a stacked bar per frame of the history, one color per
+// phase, plus the rolling percentiles as text in a tiny 3x5 pixel font.
+// Its quads are streamed every frame through hud_stream
+struct HudVertex
+{
+  glm::vec2 position; // pixels, from the bottom-left corner
+  glm::vec4 color;
+};
+
+bool hud_enabled = false;
+ShaderProgram hud_program;
+GLuint hud_vao = 0;
+StreamBuffer hud_stream;
+std::vector<HudVertex> hud_vertices;
+
+bool setup_hud();
+void submit_hud();
+
+// Render queue (renderqueue.h): the scene's draws, sorted by state
+RenderQueue render_queue;
+
+// On-disk cache of linked program binaries, keyed by the shader sources
+// and the GL vendor/renderer/version strings
+const char *shader_cache_dir = "shader_cache";
+
+GLuint vao = 0;   // Vertext Array Object to set input data
+int texture = -1; // Texture to paste on polygon, from the texture loader
+Mesh mesh;          // Geometry in vao: the cube or an OBJ file
+const char *mesh_path = NULL;
+
+// Multi-draw indirect: every range in the vao is drawn by one
+// glMultiDrawElementsIndirect call, with a command per range in
+// draw_commands_buffer. The shader picks the material of each draw
+// through gl_DrawID from the Materials block; without the extensions
+// (or with --no-multi-draw) the render queue gets a draw item per range
+struct DrawElementsIndirectCommand
+{
+  GLuint count;
+  GLuint instance_count;
+  GLuint first_index;
+  GLint base_vertex;
+  GLuint base_instance;
+};
+
+const int max_draws = 256;
+
+struct MaterialBlock
+{
+  glm::vec4 materials[max_draws]; // x: texture weight, y: vertex color weight
+};
+
+const GLuint material_binding = 1;
+bool multi_draw = true;
+GLuint draw_commands_buffer = 0;
+GLuint material_ubo = 0;
+
+bool setup_multi_draw();
+void update_draw_commands(int instances);
+
+// Instanced cube field: every instance has a fixed position in a grid,
+// an animation phase and spin speeds; the model matrices of all of them
+// are recomputed every frame in SIMD batches (animation.h), the ones in
+// view copied into the streaming buffer (straight into it without
+// culling), then drawn with one instanced draw per mesh range. Instance 0
+// is the original cube
+int num_instances = 1;
+bool instance_sweep = false; // benchmark 1, 10, 100... num_instances
+AnimationParams instance_params;
+StreamBuffer instance_stream;
+glm::mat4 *instance_models = NULL; // this frame, in instance_stream
+GLintptr instance_offset = 0;
+int draw_calls = 0;    // in the last frame
+int state_changes = 0; // issued by the render queue in the last frame
 
-int main()
+bool setup_instances(int count);
+
+// Frustum culling (culling.h): the instances are animated into a scratch
+// array, their bounding spheres (the mesh's, moved by each matrix) tested
+// against the camera frustum in the chunks they were animated in, each
+// chunk listing its visible instances from its first one, and those are
+// copied, compacted, into the streaming buffer: every chunk knows where
+// its part goes once all of them are counted. --no-cull draws them all
+struct InstanceCulling
+{
+  bool enabled = true;
+  Frustum frustum;       // this frame's
+  BoundingSphere bounds; // of the mesh
+  size_t grain = 1;      // instances per chunk
+  std::vector<glm::mat4> models;
+  std::vector<uint32_t> visible; // chunk lists, at their first instance
+  std::vector<uint32_t> counts;  // visible per chunk
+  std::atomic<long long> cull_ns{0}; // this frame, on every worker
+  int num_visible = 0;               // this frame
+  int drawn = -1;                    // instances in the draw commands
+  long frames = 0;                   // stats, since setup_instances()
+  double visible_sum = 0.0, cull_ms_sum = 0.0;
+};
+
+InstanceCulling culling;
+
+void cull_instances(void *data, size_t first, size_t count);
+void compact_instances(void *data, size_t first, size_t count);
+void cull_report();
+
+// GPU culling (--gpu-cull, GL 4.3 compute shaders): the instances are
+// animated straight into the streaming buffer, and a compute pass tests
+// each of their bounding spheres against the frustum, appending the
+// visible matrices to a buffer of their own, which the instance
+// attributes come from. Each workgroup counts its visible instances in
+// shared memory and reserves room for them with one atomic on a global
+// counter. A one-workgroup pass then copies the count into the instance
+// count of every draw command (one per mesh range) and resets it, so the
+// draws are glMultiDrawElementsIndirect or glDrawElementsIndirect calls
+// whose arguments never go through the CPU. The visible count is only
+// copied into a ring of small buffers for the stats, read back
+// gpu_cull_latency frames later, when their fence has signaled
+const int gpu_cull_latency = 3;
+const GLuint gpu_cull_group_size = 64;
+
+struct GpuCulling
+{
+  bool enabled = false;
+  ShaderProgram cull, finalize;
+  UniformVec4 planes, bounds;
+  UniformUint first, count, num_commands;
+  GLuint max_batch = 0; // instances per dispatch, GL_MAX_COMPUTE_WORK_GROUP_COUNT groups
+  GLuint instances = 0; // visible matrices, compacted
+  GLuint counter = 0;
+  GLuint commands = 0; // DrawElementsIndirectCommand per mesh range
+  GLuint readback[gpu_cull_latency] = {};
+  GLsync fences[gpu_cull_latency] = {};
+  long frame = 0;
+  int visible = -1; // last read back
+  long frames = 0;  // stats, since setup_instances()
+  double visible_sum = 0.0;
+};
+
+GpuCulling gpu_cull;
+
+bool gpu_cull_start();
+void gpu_cull_release();
+void gpu_cull_resize(int instances);
+void gpu_cull_dispatch();
+void gpu_cull_report();
+
+// Asynchronous texture loading: images are decoded by a pool of worker
+// threads, then uploaded on the GL thread through a pixel buffer object
+// into an immutable texture, at most one per frame. Until the fence after
+// the upload signals, texture_handle() returns a placeholder.
+// Sources, first usable one wins (the files must not be older than the
+// image, and their format supported by the GL):
+// - <image>.ktx2 from ktxconv (or a .ktx2 path): memory-mapped, its levels
+//   go to the GL straight from the mapping, nothing to decode or copy
+// - <image>.dds from bcenc, block compressed
+// - <image>.mips from mipgen; when it's missing or stale the worker
+//   decodes the image, builds the chain and writes the file
+struct TextureLoad
+{
+  std::string path;
+  MipChain chain; // once decoded
+  Ktx2File ktx;   // or mapped
+  bool failed;    // decode or upload, reported once: never polled again
+  GLuint texture; // 0 until uploaded
+  GLuint pbo;
+  GLsync fence;
+  bool ready;
+};
+
+struct TextureLoader
+{
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<TextureLoad> loads; // stable addresses, indexed by id
+  std::deque<int> pending;       // to decode
+  std::deque<int> decoded;       // to upload
+  bool quit = false;
+  GLuint placeholder = 0;
+  bool supported[NUM_MIP_FORMATS]; // formats the GL can sample
+};
+
+TextureLoader texture_loader;
+MipFilter mip_filter = MIP_FILTER_KAISER; // for the chains built at runtime
+bool mip_srgb = true;                     // filtered in linear light (mipgen --linear: not)
+
+bool texture_loader_start(int threads);
+void texture_loader_shutdown();
+int texture_load_async(const char *path);
+void texture_loader_update();
+GLuint texture_handle(int id);
+
+int num_job_threads = 0; // 0: one per core
+
+// Frame graph, built by update() and waited for by render() before the
+// GL submission: animate -> cull -> compact -> draw lists, or animate ->
+// draw lists without culling. The draw lists job only gets
+// what it needs from the GL thread, resolved before the graph starts
+Job *frame_job = NULL;
+float frame_time = 0.0f;
+GLuint frame_texture = 0;
+GLuint frame_programs[2]; // multi-draw or untextured, textured ranges
+
+void animate_instances(void *data, size_t first, size_t count);
+void build_draw_lists(void *data, size_t first, size_t count);
+
+// Dynamic resolution (--gpu-budget): the scene is drawn into an offscreen
+// framebuffer at a fraction of the window size and upscaled to the window
+// with a linear blit, then the HUD is drawn on top at full size. The GPU
+// time of every frame comes from timestamp queries in a ring, read
+// dynres_latency frames later so they never stall, and steers the scale
+// to keep it under the budget: down at once when a frame goes over, up a
+// step at a time when there's headroom, so it settles instead of
+// oscillating. Assuming the time goes with the pixel count, a frame
+// measured at scale s costs time / s^2 at full size, which makes up for
+// the frames still in flight when the scale changes. A software
+// rasterizer does its work on the CPU, inside the GL calls, where timer
+// queries don't see it (llvmpipe's stay near 0 whatever the resolution),
+// so a frame costs the larger of its GPU time and the CPU time of
+// render(), which waits for the scene to be drawn to blit it. The render
+// target keeps the window size and only the viewport shrinks, so a new
+// scale never reallocates it
+const int dynres_latency = 4;
+const float dynres_headroom = 0.9f;   // of the budget, the target
+const float dynres_step_up = 0.05f;   // largest increase per frame
+const float dynres_dead_band = 0.02f; // smaller increases are ignored
+
+struct DynamicResolution
+{
+  bool enabled = false;
+  double budget_ms = 0.0;
+  float min_scale = 0.5f;
+  float scale = 1.0f;
+  GLuint fbo = 0, color = 0, depth = 0; // renderbuffers
+  int fbo_width = 0, fbo_height = 0;
+  int width = 0, height = 0;          // scene viewport this frame
+  GLuint queries[dynres_latency * 2]; // begin/end timestamps
+  float scales[dynres_latency];       // of each frame in the ring
+  double cpu_ms[dynres_latency];
+  std::chrono::steady_clock::time_point cpu_start;
+  bool pending[dynres_latency] = {};
+  long frame = 0;
+  int measured = 0, over_budget = 0, dropped = 0;
+  double scale_sum = 0.0, cost_sum = 0.0; // of the frames measured
+  float scale_low = 1.0f, scale_high = 0.0f;
+};
+
+DynamicResolution dynres;
+
+bool dynres_start();
+void dynres_begin_frame();
+void dynres_resolve();
+void dynres_end_frame();
+void dynres_shutdown();
+
+// Camera state shared by every program: a std140 uniform block bound to
+// a fixed binding point. Every frame writes its block to its own region
+// of camera_stream and binds that range, so it never overwrites the one
+// the draws of the frames still in flight read
+struct CameraBlock
+{
+  glm::mat4 view;
+  glm::mat4 projection;
+  glm::vec4 viewport; // x, y, width, height
+  float time;
+  float padding[3]; // std140 rounds the block up to a vec4
+};
+
+const GLuint camera_binding = 0;
+StreamBuffer camera_stream;
+GLsizeiptr camera_block_size = 0; // rounded up to the UBO offset alignment
+CameraBlock camera;
+bool camera_dirty = true;
+
+void update_camera_matrices();
+void update_camera(double currentTime);
+
+// Shader permutations: specialized programs built from one source with
+// a #define per feature key, so there's no per-pixel branching on what a
+// draw needs. Variants are compiled on first use and cached by key
+enum ShaderFeature
+{
+  FEATURE_TEXTURED = 1 << 0,     // texture on unit 0
+  FEATURE_VERTEX_COLOR = 1 << 1, // color from the vertex position
+  FEATURE_LIT = 1 << 2,          // directional light using the normals
+  FEATURE_INSTANCED = 1 << 3,    // model matrix per instance, not uniform
+  FEATURE_MULTI_DRAW = 1 << 4,   // material per gl_DrawID, mixing the two above
+  NUM_SHADER_FEATURES = 5
+};
+
+const char *const shader_feature_defines[NUM_SHADER_FEATURES] = {"TEXTURED", "VERTEX_COLOR", "LIT", "INSTANCED",
+                                                                 "MULTI_DRAW"};
+
+struct ShaderVariant
+{
+  ShaderProgram program;
+  UniformMat4 model; // without FEATURE_INSTANCED
+};
+
+std::unordered_map<unsigned, ShaderVariant> shader_variants;
+bool lighting = false;
+
+ShaderVariant *get_shader_variant(unsigned features);
+
+// Headless benchmark mode: offscreen EGL context, fixed number of frames
+// and the fixed-step frame clock by default
+bool headless = false;
+int headless_frames = 600;
+EGLDisplay egl_display = EGL_NO_DISPLAY;
+EGLContext egl_context = EGL_NO_CONTEXT;
+EGLSurface egl_surface = EGL_NO_SURFACE;
+
+// Render thread: with a window, the main thread only waits for events
+// and handles input, publishing a snapshot of the window state after each
+// batch, while a render thread owns the GL context, runs the frame graph
+// and renders. Snapshots are double-buffered: the render thread keeps the
+// front one for the whole frame and the main thread overwrites the back
+// one. The render thread never waits for the main thread: it takes the
+// newest snapshot if there's one, or renders again with the last one, and
+// reads the clock itself, so a burst of events (a window drag, resize
+// messages) doesn't stall the animation nor the frame pacing
+struct FrameSnapshot
 {
+  int width, height; // framebuffer size
+  bool hud;
+};
+
+struct FrameHandoff
+{
+  std::mutex mutex;
+  FrameSnapshot slots[2];
+  int front = 0;      // being rendered
+  bool fresh = false; // the back slot is newer
+  bool quit = false;
+};
+
+bool render_thread_enabled = true;
+FrameSnapshot window_state; // main thread: size callback and processInput
+FrameHandoff frame_handoff;
+
+void publish_snapshot(const FrameSnapshot &snapshot);
+const FrameSnapshot *acquire_snapshot();
+void apply_snapshot(const FrameSnapshot &snapshot);
+void render_thread_main(GLFWwindow *window);
 
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit())
+// Frame clock (frameclock.h): wall time with a window and fixed steps in
+// headless mode, unless --clock says otherwise. --record writes the time
+// and window state of every frame rendered, --replay renders them again
+// (with the same --instances, --mesh... for the same frames)
+FrameClock frame_clock;
+FILE *session_log = NULL;
+
+bool next_frame(const FrameSnapshot &live, FrameSnapshot &snapshot, double &time);
+
+int main(int argc, char *argv[])
+{
+  const char *gpu_log_path = NULL;
+  int clock_mode = -1; // default of the mode
+  const char *capture_dir = NULL, *capture_format = "png";
+  for (int i = 1; i < argc; i++)
+  {
+    if (!strcmp(argv[i], "--headless"))
+      headless = true;
+    else if (!strcmp(argv[i], "--frames") && i + 1 < argc)
+      headless_frames = atoi(argv[++i]);
+    else if (!strcmp(argv[i], "--dt") && i + 1 < argc)
+      frame_clock.step = atof(argv[++i]);
+    else if (!strcmp(argv[i], "--clock") && i + 1 < argc)
+    {
+      const char *name = argv[++i];
+      if (!strcmp(name, clock_mode_names[CLOCK_WALL]))
+        clock_mode = CLOCK_WALL;
+      else if (!strcmp(name, clock_mode_names[CLOCK_FIXED]))
+        clock_mode = CLOCK_FIXED;
+      else
+      {
+        fprintf(stderr, "ERROR: unknown clock %s\n", name);
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+    {
+      session_log = session_create(argv[++i]);
+      if (!session_log)
+      {
+        fprintf(stderr, "ERROR: could not create session file %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+    {
+      if (!session_load(argv[++i], frame_clock.session) || frame_clock.session.empty())
+      {
+        fprintf(stderr, "ERROR: could not read session file %s\n", argv[i]);
+        return 1;
+      }
+      clock_mode = CLOCK_RECORDED;
+    }
+    else if (!strcmp(argv[i], "--size") && i + 1 < argc)
+      sscanf(argv[++i], "%dx%d", &gl_width, &gl_height);
+    else if (!strcmp(argv[i], "--shader-cache") && i + 1 < argc)
+      shader_cache_dir = argv[++i];
+    else if (!strcmp(argv[i], "--no-shader-cache"))
+      shader_cache_dir = NULL;
+    else if (!strcmp(argv[i], "--mesh") && i + 1 < argc)
+      mesh_path = argv[++i];
+    else if (!strcmp(argv[i], "--instances") && i + 1 < argc)
+      num_instances = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--instance-sweep"))
+      instance_sweep = true;
+    else if (!strcmp(argv[i], "--lit"))
+      lighting = true;
+    else if (!strcmp(argv[i], "--no-multi-draw"))
+      multi_draw = false;
+    else if (!strcmp(argv[i], "--no-cull"))
+      culling.enabled = false;
+    else if (!strcmp(argv[i], "--gpu-cull"))
+      gpu_cull.enabled = true;
+    else if (!strcmp(argv[i], "--jobs") && i + 1 < argc)
+      num_job_threads = std::max(1, atoi(argv[++i]));
+    else if (!strcmp(argv[i], "--no-render-thread"))
+      render_thread_enabled = false;
+    else if (!strcmp(argv[i], "--capture") && i + 1 < argc)
+      capture_dir = argv[++i];
+    else if (!strcmp(argv[i], "--capture-format") && i + 1 < argc)
+      capture_format = argv[++i];
+    else if (!strcmp(argv[i], "--gpu-budget") && i + 1 < argc)
+    {
+      dynres.budget_ms = atof(argv[++i]);
+      dynres.enabled = dynres.budget_ms > 0.0;
+    }
+    else if (!strcmp(argv[i], "--min-scale") && i + 1 < argc)
+      dynres.min_scale = (float)atof(argv[++i]);
+    else if (!strcmp(argv[i], "--mip-filter") && i + 1 < argc)
+    {
+      const char *name = argv[++i];
+      int filter = 0;
+      while (filter < NUM_MIP_FILTERS && strcmp(name, mip_filter_names[filter]))
+        filter++;
+      if (filter == NUM_MIP_FILTERS)
+      {
+        fprintf(stderr, "ERROR: unknown mip filter %s\n", name);
+        return 1;
+      }
+      mip_filter = (MipFilter)filter;
+    }
+    else if (!strcmp(argv[i], "--hud"))
+      hud_enabled = true;
+    else if (!strcmp(argv[i], "--frame-log") && i + 1 < argc)
+    {
+      if (!frame_log_open(argv[++i]))
+        return 1;
+    }
+    else if (!strcmp(argv[i], "--gpu-profile"))
+      gpu_profiler_state().enabled = true;
+    else if (!strcmp(argv[i], "--gl-state-check"))
+      gl_state_shadow().check = true;
+    else if (!strcmp(argv[i], "--gpu-log") && i + 1 < argc)
+    {
+      gpu_profiler_state().enabled = true;
+      gpu_log_path = argv[++i];
+    }
+    else
+    {
+      fprintf(stderr, "Usage: %s [--headless] [--frames N] [--dt seconds] [--size WxH]\n"
+                      "          [--shader-cache dir | --no-shader-cache] [--mesh file.obj]\n"
+                      "          [--instances N] [--instance-sweep] [--gpu-profile] [--gpu-log file.csv]\n"
+                      "          [--hud] [--frame-log file.csv|file.json] [--lit] [--gl-state-check]\n"
+                      "          [--no-multi-draw] [--no-cull | --gpu-cull] [--mip-filter box|kaiser|lanczos] [--jobs N]\n"
+                      "          [--no-render-thread]\n"
+                      "          [--clock wall|fixed] [--record session.txt | --replay session.txt]\n"
+                      "          [--capture dir] [--capture-format png|ppm] [--gpu-budget ms] [--min-scale S]\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (instance_sweep && !headless)
   {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
+    fprintf(stderr, "ERROR: --instance-sweep needs --headless\n");
     return 1;
   }
+  frame_clock.mode = clock_mode >= 0 ? (ClockMode)clock_mode : headless ? CLOCK_FIXED : CLOCK_WALL;
+  if (frame_clock.mode == CLOCK_RECORDED)
+  {
+    headless_frames = (int)frame_clock.session.size();
+    printf("Replaying %d frames\n", headless_frames);
+  }
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  window_state.width = gl_width;
+  window_state.height = gl_height;
+  window_state.hud = hud_enabled;
 
-  GLFWwindow *window = glfwCreateWindow(gl_width, gl_height, "My spinning cube", NULL, NULL);
-  if (!window)
+  GLFWwindow *window = NULL;
+  if (headless)
   {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
-    return 1;
+    if (!create_headless_context())
+      return 1;
+  }
+  else
+  {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit())
+    {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
+
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    window = glfwCreateWindow(gl_width, gl_height, "My spinning cube", NULL, NULL);
+    if (!window)
+    {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
   }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
 
   // start GLEW extension handler
   // glewExperimental = GL_TRUE;
-  glewInit();
+  // Without a GLX display GLEW still loads the core entry points, it only
+  // fails when looking for the GLX extensions
+  GLenum glew_status = glewInit();
+  if (glew_status != GLEW_OK && !(headless && glew_status == GLEW_ERROR_NO_GLX_DISPLAY))
+  {
+    fprintf(stderr, "ERROR: could not start GLEW: %s\n", glewGetErrorString(glew_status));
+    shutdown_all(false);
+    return 1;
+  }
 
   // get version info
   const GLubyte *vendor = glGetString(GL_VENDOR);                        // get vendor string
@@ -73,58 +780,28 @@ int main()
   glEnable(GL_DEPTH_TEST);
   glDepthFunc(GL_LESS); // set a smaller value as "closer"
 
-  // Vertex Shader
-  const char *vertex_shader =
-      "#version 130\n"
-      "in vec4 v_pos;\n"
-      "in vec2 texCoord;\n"      // Added texture coordinate input
-      "out vec2 fragTexCoord;\n" // Pass texture coordinate to fragment shader
-      "out vec4 vs_color;\n"
-      "uniform mat4 mv_matrix;\n"
-      "uniform mat4 proj_matrix;\n"
-      "void main() {\n"
-      "  gl_Position = proj_matrix * mv_matrix * v_pos;\n"
-      "  fragTexCoord = texCoord;\n" // Pass texture coordinate
-      "  vs_color = v_pos * 2.0 + vec4(0.4, 0.4, 0.4, 0.0);\n"
-      "}\n";
-
-  // Fragment Shader
-  const char *fragment_shader =
-      "#version 130\n"
-      "in vec2 fragTexCoord;\n" // Received texture coordinate
-      "in vec4 vs_color;\n"
-      "out vec4 frag_color;\n"
-      "uniform sampler2D tex;\n"     // Texture sampler
-      "uniform bool applyTexture;\n" // Control the texture application
-      "void main() {\n"
-      "  if (applyTexture) {\n"
-      "    frag_color = texture(tex, fragTexCoord);\n" // Apply texture
-      "  } else {\n"
-      "    frag_color = vs_color;\n" // Default color for other faces
-      "  }\n"
-      "}\n";
-
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
-
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
+  // gl_DrawID comes from ARB_shader_draw_parameters (core in 4.6)
+  if (multi_draw && !((GLEW_VERSION_4_3 || GLEW_ARB_multi_draw_indirect) && GLEW_ARB_shader_draw_parameters))
+  {
+    printf("Multi-draw indirect not supported, drawing each mesh range on its own\n");
+    multi_draw = false;
+  }
 
-  // Vertex Array Object
-  glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
+  // Shader variants for the cube field, compiled (or loaded from the
+  // program cache) now rather than on their first draw
+  for (int i = 0; i < (multi_draw ? 1 : 2); i++)
+  {
+    unsigned features = (i ? FEATURE_TEXTURED : FEATURE_VERTEX_COLOR) | FEATURE_INSTANCED;
+    if (multi_draw)
+      features = FEATURE_TEXTURED | FEATURE_VERTEX_COLOR | FEATURE_INSTANCED | FEATURE_MULTI_DRAW;
+    if (lighting)
+      features |= FEATURE_LIT;
+    if (!get_shader_variant(features))
+    {
+      shutdown_all(false);
+      return 1;
+    }
+  }
 
   // Cube to be rendered
   //
@@ -185,7 +862,8 @@ int main()
       0.25f, 0.25f, -0.25f   // 3
   };
 
-  float texCoords[] = {
+  // Every face uses the same corner order, so the same texture coords
+  const float texCoords[] = {
       1.0f, 0.0f,
       0.0f, 0.0f,
       1.0f, 1.0f,
@@ -195,140 +873,2475 @@ int main()
       0.0f, 0.0f,
   };
 
-  // Uniforms
-  // - Model-View matrix
-  // - Projection matrix
-  mv_location = glGetUniformLocation(shader_program, "mv_matrix");
-  proj_location = glGetUniformLocation(shader_program, "proj_matrix");
+  // Unique vertices and indices, the first face (6 indices) textured
+  MeshBuilder builder;
+  if (mesh_path)
+  {
+    if (!load_obj(mesh_path, builder))
+    {
+      shutdown_all(false);
+      return 1;
+    }
+  }
+  else
+  {
+    for (int i = 0; i < 36; i += 3)
+    {
+      if (i == 0 || i == 6)
+        mesh_begin_range(builder, i == 0);
+
+      const GLfloat *p = &vertex_positions[i * 3];
+      glm::vec3 a(p[0], p[1], p[2]), b(p[3], p[4], p[5]), c(p[6], p[7], p[8]);
+      glm::vec3 normal = glm::normalize(glm::cross(b - a, c - a));
+      for (int j = 0; j < 3; j++)
+      {
+        const float *uv = &texCoords[((i + j) % 6) * 2];
+        MeshVertex vertex = {glm::vec3(p[j * 3], p[j * 3 + 1], p[j * 3 + 2]), glm::vec2(uv[0], uv[1]), normal};
+        mesh_add_vertex(builder, vertex);
+      }
+    }
+  }
+  float acmr_before = mesh_acmr(builder.mesh, 16);
+  mesh_optimize(builder.mesh);
+  printf("Mesh: %zu triangles, %zu unique vertices, ACMR (16 entries) %.3f -> %.3f\n",
+         builder.mesh.indices.size() / 3, builder.mesh.vertices.size(), acmr_before, mesh_acmr(builder.mesh, 16));
+  // Every mesh sharing the vertex format goes into the same buffers
+  mesh_append(mesh, builder.mesh);
+  culling.bounds =
+      bounding_sphere(&mesh.vertices[0].position.x, mesh.vertices.size(), sizeof(MeshVertex) / sizeof(float));
+  if (mesh.ranges.size() > (size_t)max_draws)
+    multi_draw = false;
+
+  // UBO: camera blocks, one per frame in flight, filled in by update_camera()
+  GLint ubo_alignment = 256;
+  glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &ubo_alignment);
+  camera_block_size = (sizeof(CameraBlock) + ubo_alignment - 1) / ubo_alignment * ubo_alignment;
+  if (!stream_create(camera_stream, camera_block_size))
+  {
+    shutdown_all(false);
+    return 1;
+  }
 
-  // VAO, VBOs
+  // VAO, VBO (interleaved vertices) and EBO (indices)
   GLuint vbo[2];
   glGenVertexArrays(1, &vao);
   glGenBuffers(2, vbo);
 
-  glBindVertexArray(vao);
+  gl_state_bind_vertex_array(vao);
 
-  // VBO: 3D vertices
-  glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_positions), vertex_positions, GL_STATIC_DRAW);
+  // VBO: 3D vertices, texture coords and normals
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, vbo[0]);
+  glBufferData(GL_ARRAY_BUFFER, mesh.vertices.size() * sizeof(MeshVertex), mesh.vertices.data(), GL_STATIC_DRAW);
   // 0: vertex position attribute
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, position));
   glEnableVertexAttribArray(0);
-
-  // VBO: Texture coords
-  glBindBuffer(GL_ARRAY_BUFFER, vbo[1]);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(texCoords), texCoords, GL_STATIC_DRAW);
   // 1: vertex texCoord attribute
-  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+  glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, uv));
   glEnableVertexAttribArray(1);
+  // 2: vertex normal attribute
+  glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(MeshVertex), (void *)offsetof(MeshVertex, normal));
+  glEnableVertexAttribArray(2);
+
+  // EBO: indices (the binding is part of the vao state)
+  gl_state_bind_buffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh.indices.size() * sizeof(GLuint), mesh.indices.data(), GL_STATIC_DRAW);
+
+  // Per-instance model matrices, one column per attribute location. They
+  // come from the streaming buffer, pointed at every frame in render()
+  for (int column = 0; column < 4; column++)
+  {
+    // 3..6: instance model matrix attribute, advancing once per instance
+    glVertexAttribDivisor(3 + column, 1);
+    glEnableVertexAttribArray(3 + column);
+  }
 
   // Unbind vbo (it was conveniently registered by VertexAttribPointer)
-  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, 0);
 
   // Unbind vao
-  glBindVertexArray(0);
+  gl_state_bind_vertex_array(0);
 
-  // Create texture object
-  glGenTextures(1, &texture);
-  glBindTexture(GL_TEXTURE_2D, texture);
-
-  // Set the texture wrapping/filtering options (on the currently bound texture object)
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  if (multi_draw && !setup_multi_draw())
+  {
+    shutdown_all(false);
+    return 1;
+  }
+  if (gpu_cull.enabled)
+  {
+    gpu_cull.enabled = gpu_cull_start();
+    if (gpu_cull.enabled)
+      culling.enabled = false;
+  }
 
-  // Load image for texture
-  int width, height, nrChannels;
-  // Before loading the image, we flip it vertically because
-  // Images: 0.0 top of y-axis  OpenGL: 0.0 bottom of y-axis
-  stbi_set_flip_vertically_on_load(1);
-  unsigned char *data = stbi_load("texture.jpg", &width, &height, &nrChannels, 0);
+  // Texture: decoded in the background, the cubes show a placeholder
+  // until it's uploaded
+  unsigned threads = std::thread::hardware_concurrency();
+  if (!texture_loader_start(threads > 2 ? std::min(threads - 1, 4u) : 1))
+  {
+    shutdown_all(false);
+    return 1;
+  }
   // Image from http://www.flickr.com/photos/seier/4364156221
   // CC-BY-SA 2.0
-  if (data)
+  texture = texture_load_async("texture.jpg");
+
+  // Workers for the frame graph, the main thread being one of them
+  if (!job_system_start(num_job_threads ? num_job_threads : std::max(threads, 1u)))
   {
-    // Generate texture from image
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
+    shutdown_all(false);
+    return 1;
   }
-  else
+
+  if (gpu_profiler_state().enabled)
+    gpu_profiler_init(gpu_log_path);
+  if ((capture_dir && !capture_start(capture_dir, capture_format)) || (dynres.enabled && !dynres_start()) ||
+      !setup_hud())
+  {
+    shutdown_all(true);
+    return 1;
+  }
+
+  if (instance_sweep)
+  {
+    printf("%10s %10s %12s %12s %12s\n", "instances", "draws", "update ms", "render ms", "frame ms");
+    // Powers of ten, and last the requested count if it isn't one
+    for (int count = 1;; count = (int)std::min(count * 10L, (long)num_instances))
+    {
+      if (!setup_instances(count))
+      {
+        shutdown_all(true);
+        return 1;
+      }
+      HeadlessStats stats = run_headless(headless_frames);
+      printf("%10d %10d %12.3f %12.3f %12.3f\n", count, draw_calls,
+             stats.update.median, stats.cpu.median, stats.frame.median);
+      if (count == num_instances)
+        break;
+    }
+    shutdown_all(true);
+    return 0;
+  }
+
+  if (!setup_instances(num_instances))
   {
-    printf("Failed to load texture\n");
+    shutdown_all(true);
+    return 1;
+  }
+
+  if (headless)
+  {
+    HeadlessStats stats = run_headless(headless_frames);
+    printf("%d frames, %s clock, %d instances, %d draw calls and %d state changes per frame\n",
+           headless_frames, clock_mode_names[frame_clock.mode], num_instances, draw_calls, state_changes);
+    const GlState &gl_state = gl_state_shadow();
+    printf("GL state: %d calls per frame, %d redundant ones elided\n", gl_state.frame_calls, gl_state.frame_elided);
+    if (gl_state.check)
+      printf("GL state check: %d mismatches\n", gl_state.mismatches);
+    print_frame_stats("Update", stats.update);
+    print_frame_stats("CPU", stats.cpu);
+    print_frame_stats("Frame", stats.frame);
+    if (stats.gpu_timed)
+      print_frame_stats("GPU", stats.gpu);
+    else
+      printf("GPU    unavailable, no timer queries\n");
+    job_report();
+    cull_report();
+    gpu_cull_report();
+    shutdown_all(true);
+    return 0;
   }
 
-  // Free image once texture is generated
-  stbi_image_free(data);
+  if (render_thread_enabled)
+  {
+    // The context moves to the render thread; the main thread sleeps
+    // until there are events
+    publish_snapshot(window_state);
+    clock_start(frame_clock);
+    glfwMakeContextCurrent(NULL);
+    std::thread renderer(render_thread_main, window);
+    while (!glfwWindowShouldClose(window))
+    {
+      glfwWaitEvents();
+      processInput(window);
+      publish_snapshot(window_state);
+    }
+    {
+      std::lock_guard<std::mutex> lock(frame_handoff.mutex);
+      frame_handoff.quit = true;
+    }
+    renderer.join();
+    shutdown_all(false);
+    return 0;
+  }
 
   // Render loop
+  clock_start(frame_clock);
   while (!glfwWindowShouldClose(window))
   {
+    frame_begin();
 
     processInput(window);
+    FrameSnapshot snapshot;
+    double currentTime;
+    if (!next_frame(window_state, snapshot, currentTime))
+      break;
+    apply_snapshot(snapshot);
+    frame_phase(PHASE_INPUT);
 
-    render(glfwGetTime());
+    update(currentTime);
+    frame_phase(PHASE_UPDATE);
+
+    render(currentTime);
+    frame_phase(PHASE_RENDER);
 
     glfwSwapBuffers(window);
+    frame_phase(PHASE_SWAP);
 
     glfwPollEvents();
+    frame_phase(PHASE_POLL);
+
+    frame_end();
   }
 
-  glfwTerminate();
+  shutdown_all(true);
 
   return 0;
 }
 
-void render(double currentTime)
+// Every way out of main once the context is up: the GL side (when it was
+// started and the render thread didn't already release it on its way out),
+// then the threads, the logs and the context itself. Safe on whatever
+// never started
+void shutdown_all(bool release_gl)
 {
-  float f = (float)currentTime * 0.3f;
+  if (release_gl)
+  {
+    capture_shutdown();
+    dynres_shutdown();
+    gpu_profiler_shutdown();
+  }
+  texture_loader_shutdown();
+  job_system_shutdown();
+  frame_log_close();
+  if (session_log)
+    fclose(session_log);
+  session_log = NULL;
+  if (headless)
+    destroy_headless_context();
+  else
+    glfwTerminate();
+}
 
-  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  glUseProgram(shader_program);
+// Offscreen context for machines without display (and maybe without GPU):
+// a pbuffer on Mesa's surfaceless platform when available (llvmpipe),
+// the default EGL display otherwise
+bool create_headless_context()
+{
+  const char *client_extensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  if (client_extensions && strstr(client_extensions, "EGL_MESA_platform_surfaceless"))
+  {
+    PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (eglGetPlatformDisplayEXT)
+      egl_display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  }
+  if (egl_display == EGL_NO_DISPLAY)
+    egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
 
-  // Activa la textura
-  glActiveTexture(GL_TEXTURE0);
-  glBindTexture(GL_TEXTURE_2D, texture);
-  glUniform1i(glGetUniformLocation(shader_program, "tex"), 0);
+  EGLint major, minor;
+  if (egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor))
+  {
+    fprintf(stderr, "ERROR: could not initialize EGL (0x%x)\n", eglGetError());
+    return false;
+  }
 
-  // Configuraciones de la matriz de vista/proyección
-  glm::mat4 projection = glm::perspective(glm::radians(50.0f), (float)gl_width / (float)gl_height, 0.1f, 1000.0f); // Cambiar a radians a 10.0f para ver mas de cerca
-  glUniformMatrix4fv(proj_location, 1, GL_FALSE, glm::value_ptr(projection));
+  const EGLint config_attribs[] = {
+      EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+      EGL_RED_SIZE, 8,
+      EGL_GREEN_SIZE, 8,
+      EGL_BLUE_SIZE, 8,
+      EGL_DEPTH_SIZE, 24,
+      EGL_NONE};
+  EGLConfig config;
+  EGLint num_configs = 0;
+  if (!eglChooseConfig(egl_display, config_attribs, &config, 1, &num_configs) || num_configs < 1)
+  {
+    fprintf(stderr, "ERROR: no suitable EGL pbuffer config\n");
+    eglTerminate(egl_display);
+    return false;
+  }
 
-  // Matriz de modelo con rotaciones y traslaciones
-  glm::mat4 model = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.0f, -4.0f));
-  model = glm::translate(model, glm::vec3(sinf(2.1f * f) * 0.5f, cosf(1.7f * f) * 0.5f, sinf(1.3f * f) * cosf(1.5f * f) * 2.0f));
-  model = glm::rotate(model, glm::radians((float)currentTime * 45.0f), glm::vec3(0.0f, 1.0f, 0.0f));
-  model = glm::rotate(model, glm::radians((float)currentTime * 81.0f), glm::vec3(1.0f, 0.0f, 0.0f));
-  //model = glm::rotate(model, glm::radians(180.0f), glm::vec3(0.0f, 1.0f, 0.0f)); // Comentar las 3 lineas anteriores y descomentar esta para ver la textura
+  const EGLint pbuffer_attribs[] = {EGL_WIDTH, gl_width, EGL_HEIGHT, gl_height, EGL_NONE};
+  egl_surface = eglCreatePbufferSurface(egl_display, config, pbuffer_attribs);
 
-  // Envía las matrices al shader
-  glUniformMatrix4fv(mv_location, 1, GL_FALSE, glm::value_ptr(model));
+  eglBindAPI(EGL_OPENGL_API);
+  egl_context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, NULL);
+  if (egl_surface == EGL_NO_SURFACE || egl_context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(egl_display, egl_surface, egl_surface, egl_context))
+  {
+    fprintf(stderr, "ERROR: could not create offscreen GL context (0x%x)\n", eglGetError());
+    destroy_headless_context();
+    return false;
+  }
 
-  glBindVertexArray(vao);
+  printf("EGL version %d.%d, headless %dx%d\n", major, minor, gl_width, gl_height);
+  glViewport(0, 0, gl_width, gl_height);
+  return true;
+}
 
-  // Define si aplicar la textura o no
-  GLint applyTextureLoc = glGetUniformLocation(shader_program, "applyTexture");
+void destroy_headless_context()
+{
+  eglMakeCurrent(egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  if (egl_context != EGL_NO_CONTEXT)
+    eglDestroyContext(egl_display, egl_context);
+  if (egl_surface != EGL_NO_SURFACE)
+    eglDestroySurface(egl_display, egl_surface);
+  eglTerminate(egl_display);
+}
 
-  // Dibuja la cara texturizada
-  glUniform1i(applyTextureLoc, GL_TRUE);
-  glDrawArrays(GL_TRIANGLES, 0, 6); // Dibuja solo la cara frontal
+// Main thread: replaces the back snapshot, older ones are never rendered
+void publish_snapshot(const FrameSnapshot &snapshot)
+{
+  std::lock_guard<std::mutex> lock(frame_handoff.mutex);
+  frame_handoff.slots[1 - frame_handoff.front] = snapshot;
+  frame_handoff.fresh = true;
+}
 
-  // Dibuja el resto del cubo sin textura
-  glUniform1i(applyTextureLoc, GL_FALSE);
-  glDrawArrays(GL_TRIANGLES, 6, 36 - 6); // Dibuja el resto del cubo
+// Render thread: the newest snapshot, as the front one, which stays
+// untouched until the next call. NULL when the main thread is quitting
+const FrameSnapshot *acquire_snapshot()
+{
+  std::lock_guard<std::mutex> lock(frame_handoff.mutex);
+  if (frame_handoff.quit)
+    return NULL;
+  if (frame_handoff.fresh)
+  {
+    frame_handoff.front = 1 - frame_handoff.front;
+    frame_handoff.fresh = false;
+  }
+  return &frame_handoff.slots[frame_handoff.front];
 }
 
-void processInput(GLFWwindow *window)
+// Time and window state of the next frame: from the session being
+// replayed, or from the frame clock and the live state. Recorded when
+// asked to. False once the replayed session is over
+bool next_frame(const FrameSnapshot &live, FrameSnapshot &snapshot, double &time)
 {
-  if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-    glfwSetWindowShouldClose(window, 1);
+  if (clock_finished(frame_clock))
+    return false;
+  SessionFrame frame = {};
+  time = clock_tick(frame_clock, &frame);
+  snapshot = live;
+  if (frame_clock.mode == CLOCK_RECORDED)
+  {
+    snapshot.width = frame.width;
+    snapshot.height = frame.height;
+    snapshot.hud = frame.hud;
+  }
+  if (session_log)
+  {
+    frame.time = time;
+    frame.width = snapshot.width;
+    frame.height = snapshot.height;
+    frame.hud = snapshot.hud;
+    session_write(session_log, frame);
+  }
+  return true;
+}
+
+// On the GL thread, before update()
+void apply_snapshot(const FrameSnapshot &snapshot)
+{
+  if (snapshot.width != gl_width || snapshot.height != gl_height)
+  {
+    gl_width = snapshot.width;
+    gl_height = snapshot.height;
+    camera_dirty = true;
+    glViewport(0, 0, gl_width, gl_height); // Si aumentamos o reducimos la pantalla se ajusta
+  }
+  hud_enabled = snapshot.hud;
+}
+
+// Owns the GL context until the main thread quits. Events are handled on
+// the main thread, so the input phase of the frame timings is just taking
+// the snapshot, and the poll phase is always 0
+void render_thread_main(GLFWwindow *window)
+{
+  glfwMakeContextCurrent(window);
+  for (;;)
+  {
+    frame_begin();
+    const FrameSnapshot *live = acquire_snapshot();
+    if (!live)
+      break;
+    FrameSnapshot snapshot;
+    double currentTime;
+    if (!next_frame(*live, snapshot, currentTime))
+    {
+      // Replay over; the main thread is waiting for events
+      glfwSetWindowShouldClose(window, 1);
+      glfwPostEmptyEvent();
+      break;
+    }
+    apply_snapshot(snapshot);
+    frame_phase(PHASE_INPUT);
+
+    update(currentTime);
+    frame_phase(PHASE_UPDATE);
+
+    render(currentTime);
+    frame_phase(PHASE_RENDER);
+
+    glfwSwapBuffers(window);
+    frame_phase(PHASE_SWAP);
+
+    frame_end();
+  }
+  capture_shutdown();
+  dynres_shutdown();
+  gpu_profiler_shutdown();
+  glfwMakeContextCurrent(NULL);
+}
+
+FrameStats frame_stats(std::vector<double> samples)
+{
+  FrameStats stats = {0.0, 0.0, 0.0, 0.0};
+  if (samples.empty())
+    return stats;
+  std::sort(samples.begin(), samples.end());
+  size_t n = samples.size();
+  double sum = 0.0;
+  for (size_t i = 0; i < n; i++)
+    sum += samples[i];
+  stats.min = samples[0];
+  stats.median = samples[n / 2];
+  stats.p99 = samples[std::min(n - 1, (size_t)(n * 0.99))];
+  stats.mean = sum / n;
+  return stats;
+}
+
+void print_frame_stats(const char *label, const FrameStats &stats)
+{
+  printf("%-6s min %8.3f ms  median %8.3f ms  p99 %8.3f ms  mean %8.3f ms\n", label,
+         stats.min, stats.median, stats.p99, stats.mean);
+}
+
+// Render a fixed number of frames with a deterministic clock. Update time
+// is the animation of the instances, CPU time the submission cost of
+// render(), frame time waits for the frame to be
+// finished (pbuffer swaps don't flush and software rasterizers only do
+// their actual work when flushed) and GPU time comes from
+// GL_TIME_ELAPSED queries (GL 3.3 or ARB_timer_query), read back a few
+// frames later so the pipeline doesn't stall. The first frames pay for lazy driver setup (shader
+// compilation, texture upload...) and are left out of the statistics
+HeadlessStats run_headless(int frames)
+{
+  const int num_queries = 3;
+  const int warmup_frames = 2;
+  GLuint queries[num_queries];
+  bool timed = GLEW_VERSION_3_3 || GLEW_ARB_timer_query;
+  if (timed)
+    glGenQueries(num_queries, queries);
+
+  std::vector<double> update_ms, cpu_ms, frame_ms, gpu_ms;
+  update_ms.reserve(frames);
+  cpu_ms.reserve(frames);
+  frame_ms.reserve(frames);
+  gpu_ms.reserve(frames);
+
+  clock_start(frame_clock);
+  for (int frame = 0; frame < frames + num_queries - 1; frame++)
+  {
+    if (frame < frames)
+    {
+      // No events without a window: the input is the initial window
+      // state, or the session's when replaying one (as many frames)
+      frame_begin();
+      FrameSnapshot snapshot;
+      double time;
+      next_frame(window_state, snapshot, time);
+      apply_snapshot(snapshot);
+      frame_phase(PHASE_INPUT);
+      update(time);
+      frame_phase(PHASE_UPDATE);
+      if (timed)
+        glBeginQuery(GL_TIME_ELAPSED, queries[frame % num_queries]);
+      render(time);
+      frame_phase(PHASE_RENDER);
+      eglSwapBuffers(egl_display, egl_surface);
+      if (timed)
+        glEndQuery(GL_TIME_ELAPSED);
+      glFinish();
+      frame_phase(PHASE_SWAP);
+      frame_end();
+      if (frame >= warmup_frames)
+      {
+        const FrameTimings &timings = frame_recorder.current;
+        update_ms.push_back(timings.phase_ms[PHASE_UPDATE]);
+        cpu_ms.push_back(timings.phase_ms[PHASE_RENDER]);
+        frame_ms.push_back(timings.total_ms);
+      }
+    }
+
+    int done = frame - (num_queries - 1);
+    if (timed && done >= 0)
+    {
+      GLuint64 elapsed = 0;
+      glGetQueryObjectui64v(queries[done % num_queries], GL_QUERY_RESULT, &elapsed);
+      if (done >= warmup_frames)
+        gpu_ms.push_back(elapsed / 1.0e6);
+    }
+  }
+
+  if (timed)
+    glDeleteQueries(num_queries, queries);
+
+  HeadlessStats stats;
+  stats.update = frame_stats(update_ms);
+  stats.cpu = frame_stats(cpu_ms);
+  stats.frame = frame_stats(frame_ms);
+  stats.gpu = frame_stats(gpu_ms);
+  stats.gpu_timed = timed;
+  return stats;
+}
+
+// Lay out the instances in a cube-shaped grid, centered in front of the
+// camera and going away from it, with scattered animation phases
+bool setup_instances(int count)
+{
+  const float spacing = 1.5f;
+  int side = (int)ceil(cbrt((double)count) - 1e-9);
+
+  instance_params.resize(count);
+  for (int i = 0; i < count; i++)
+  {
+    int x = i % side, y = (i / side) % side, z = i / (side * side);
+    instance_params.x[i] = (x - (side - 1) * 0.5f) * spacing;
+    instance_params.y[i] = (y - (side - 1) * 0.5f) * spacing;
+    instance_params.z[i] = -4.0f - z * spacing;
+    instance_params.phase[i] = fmodf(i * 0.618034f, 1.0f) * 10.0f;
+    instance_params.yaw_speed[i] = glm::radians(45.0f);
+    instance_params.pitch_speed[i] = glm::radians(81.0f);
+  }
+  // The original single cube is not offset nor shifted in time
+  instance_params.x[0] = instance_params.y[0] = 0.0f;
+  instance_params.z[0] = -4.0f;
+  instance_params.phase[0] = 0.0f;
+
+  culling.models.resize(count);
+  culling.visible.resize(count);
+  culling.frames = 0;
+  culling.visible_sum = culling.cull_ms_sum = 0.0;
+
+  // Room for one frame of matrices per region
+  stream_destroy(instance_stream);
+  if (!stream_create(instance_stream, count * sizeof(glm::mat4)))
+    return false;
+  if (multi_draw)
+    update_draw_commands(count);
+  if (gpu_cull.enabled)
+    gpu_cull_resize(count);
+  return true;
+}
+
+// Commands and materials for every mesh range; the material table is
+// indexed by gl_DrawID, i.e. by the command
+bool setup_multi_draw()
+{
+  MaterialBlock block = {};
+  for (size_t i = 0; i < mesh.ranges.size(); i++)
+    block.materials[i] = mesh.ranges[i].textured ? glm::vec4(1.0f, 0.0f, 0.0f, 0.0f) : glm::vec4(0.0f, 1.0f, 0.0f, 0.0f);
+  glGenBuffers(1, &material_ubo);
+  gl_state_bind_buffer(GL_UNIFORM_BUFFER, material_ubo);
+  glBufferData(GL_UNIFORM_BUFFER, sizeof(MaterialBlock), &block, GL_STATIC_DRAW);
+  glBindBufferBase(GL_UNIFORM_BUFFER, material_binding, material_ubo);
+
+  glGenBuffers(1, &draw_commands_buffer);
+  gl_state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, draw_commands_buffer);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER, mesh.ranges.size() * sizeof(DrawElementsIndirectCommand), NULL,
+               GL_STATIC_DRAW);
+  if (glGetError() != GL_NO_ERROR)
+  {
+    fprintf(stderr, "ERROR: could not create the multi-draw buffers\n");
+    return false;
+  }
+  printf("Multi-draw indirect: %zu draws per call\n", mesh.ranges.size());
+  return true;
+}
+
+// Only the instance count changes after setup
+void update_draw_commands(int instances)
+{
+  culling.drawn = instances;
+  std::vector<DrawElementsIndirectCommand> commands(mesh.ranges.size());
+  for (size_t i = 0; i < mesh.ranges.size(); i++)
+  {
+    const MeshRange &range = mesh.ranges[i];
+    DrawElementsIndirectCommand command = {(GLuint)range.count, (GLuint)instances, range.first, range.base_vertex, 0};
+    commands[i] = command;
+  }
+  gl_state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, draw_commands_buffer);
+  glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data());
+}
+
+void texture_worker()
+{
+  std::unique_lock<std::mutex> lock(texture_loader.mutex);
+  for (;;)
+  {
+    texture_loader.wake.wait(lock, [] { return texture_loader.quit || !texture_loader.pending.empty(); });
+    if (texture_loader.quit)
+      return;
+    int id = texture_loader.pending.front();
+    texture_loader.pending.pop_front();
+    TextureLoad &load = texture_loader.loads[id];
+
+    lock.unlock();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string ktx_path = ktx2_path(load.path.c_str());
+    std::string dds_path = bc_dds_path(load.path.c_str());
+    std::string cache_path = mip_cache_path(load.path.c_str());
+    bool cached = (ktx_path == load.path || mip_cache_fresh(load.path.c_str(), ktx_path.c_str())) &&
+                  ktx2_open(ktx_path.c_str(), load.ktx);
+    if (cached && !texture_loader.supported[load.ktx.chain.format])
+    {
+      ktx2_close(load.ktx);
+      cached = false;
+    }
+    if (cached)
+      printf("Texture %s: mapped %zu bytes in %.2f ms\n", ktx_path.c_str(), load.ktx.size,
+             std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    if (!cached)
+      cached = mip_cache_fresh(load.path.c_str(), dds_path.c_str()) && bc_load_dds(dds_path.c_str(), load.chain) &&
+               texture_loader.supported[load.chain.format];
+    // A .mips file is only reused when it was built the way this run would
+    if (!cached)
+      cached = mip_cache_fresh(load.path.c_str(), cache_path.c_str()) && mip_load(cache_path.c_str(), load.chain) &&
+               load.chain.filter == mip_filter && load.chain.srgb == mip_srgb;
+    if (!cached)
+    {
+      int width, height, channels;
+      unsigned char *pixels = stbi_load(load.path.c_str(), &width, &height, &channels, 4);
+      if (pixels)
+      {
+        mip_generate(pixels, width, height, mip_filter, mip_srgb, load.chain);
+        stbi_image_free(pixels);
+        printf("Texture %s: %d mip levels built in %.2f ms (%s)\n", load.path.c_str(), load.chain.levels,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(),
+               mip_kernels().name);
+        if (!mip_save(cache_path.c_str(), load.chain))
+          fprintf(stderr, "WARNING: could not write %s\n", cache_path.c_str());
+      }
+      else
+        load.chain = MipChain();
+    }
+    lock.lock();
+
+    if (load.chain.data.empty() && !load.ktx.mapping)
+    {
+      printf("Failed to load texture %s\n", load.path.c_str());
+      load.failed = true;
+    }
+    else
+      texture_loader.decoded.push_back(id);
+  }
+}
+
+bool texture_loader_start(int threads)
+{
+  // Before loading the images, we flip them vertically because
+  // Images: 0.0 top of y-axis  OpenGL: 0.0 bottom of y-axis
+  // (a global in stb_image, so it's set before starting the workers)
+  stbi_set_flip_vertically_on_load(1);
+
+  // Mid gray and white checkerboard
+  const unsigned char placeholder[] = {128, 128, 128, 255, 255, 255, 255, 255,
+                                       255, 255, 255, 255, 128, 128, 128, 255};
+  glGenTextures(1, &texture_loader.placeholder);
+  gl_state_bind_texture(0, texture_loader.placeholder);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 2, 2, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholder);
+
+  texture_loader.supported[MIP_FORMAT_RGBA8] = true;
+  texture_loader.supported[MIP_FORMAT_BC1] = texture_loader.supported[MIP_FORMAT_BC3] =
+      GLEW_EXT_texture_compression_s3tc;
+  texture_loader.supported[MIP_FORMAT_BC7] = GLEW_VERSION_4_2 || GLEW_ARB_texture_compression_bptc;
+
+  texture_loader.quit = false;
+  for (int i = 0; i < threads; i++)
+    texture_loader.workers.push_back(std::thread(texture_worker));
+  printf("Texture loader: %d threads\n", threads);
+  return true;
+}
+
+// Stops the workers; the GL objects go away with the context
+void texture_loader_shutdown()
+{
+  {
+    std::lock_guard<std::mutex> lock(texture_loader.mutex);
+    texture_loader.quit = true;
+  }
+  texture_loader.wake.notify_all();
+  for (size_t i = 0; i < texture_loader.workers.size(); i++)
+    texture_loader.workers[i].join();
+  texture_loader.workers.clear();
+
+  for (size_t i = 0; i < texture_loader.loads.size(); i++)
+  {
+    texture_loader.loads[i].chain = MipChain();
+    ktx2_close(texture_loader.loads[i].ktx);
+  }
+}
+
+// Queue an image file for decoding; returns the id for texture_handle()
+int texture_load_async(const char *path)
+{
+  TextureLoad load = {};
+  load.path = path;
+  int id;
+  {
+    std::lock_guard<std::mutex> lock(texture_loader.mutex);
+    id = (int)texture_loader.loads.size();
+    texture_loader.loads.push_back(load);
+    texture_loader.pending.push_back(id);
+  }
+  texture_loader.wake.notify_one();
+  return id;
+}
+
+// Once per frame on the GL thread: retire the uploads whose fence has
+// signaled and start the upload of one decoded image
+void texture_loader_update()
+{
+  TextureLoad *upload = NULL;
+  {
+    std::lock_guard<std::mutex> lock(texture_loader.mutex);
+    for (size_t i = 0; i < texture_loader.loads.size(); i++)
+    {
+      // Failed loads were reported once and keep the placeholder
+      TextureLoad &load = texture_loader.loads[i];
+      if (load.failed || load.ready)
+        continue;
+      if (load.fence && glClientWaitSync(load.fence, 0, 0) != GL_TIMEOUT_EXPIRED)
+      {
+        glDeleteSync(load.fence);
+        glDeleteBuffers(1, &load.pbo);
+        load.fence = 0;
+        load.pbo = 0;
+        load.ready = true;
+      }
+    }
+    if (!texture_loader.decoded.empty())
+    {
+      upload = &texture_loader.loads[texture_loader.decoded.front()];
+      texture_loader.decoded.pop_front();
+    }
+  }
+  if (!upload)
+    return;
+
+  // A mapped file is the source of the upload as it is. Otherwise the
+  // copy into the PBO is the only work on this thread; the transfer to
+  // the texture happens asynchronously in the driver
+  const MipChain &chain = upload->ktx.mapping ? upload->ktx.chain : upload->chain;
+  const unsigned char *source = (const unsigned char *)upload->ktx.mapping;
+  size_t size = upload->ktx.mapping ? upload->ktx.size : chain.data.size();
+  if (!source)
+  {
+    glGenBuffers(1, &upload->pbo);
+    gl_state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, upload->pbo);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+    void *mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    if (!mapped)
+    {
+      // Like a decode failure: the placeholder stays
+      printf("Failed to upload texture %s\n", upload->path.c_str());
+      gl_state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+      glDeleteBuffers(1, &upload->pbo);
+      upload->pbo = 0;
+      upload->chain = MipChain();
+      std::lock_guard<std::mutex> lock(texture_loader.mutex);
+      upload->failed = true;
+      return;
+    }
+    memcpy(mapped, chain.data.data(), size);
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+  }
+  else
+    gl_state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+  const GLenum internal_formats[NUM_MIP_FORMATS] = {GL_RGBA8, GL_COMPRESSED_RGB_S3TC_DXT1_EXT,
+                                                     GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, GL_COMPRESSED_RGBA_BPTC_UNORM};
+  GLenum internal_format = internal_formats[chain.format];
+  bool storage = GLEW_VERSION_4_2 || GLEW_ARB_texture_storage;
+  glGenTextures(1, &upload->texture);
+  gl_state_bind_texture(0, upload->texture);
+  if (storage)
+    glTexStorage2D(GL_TEXTURE_2D, chain.levels, internal_format, chain.width, chain.height);
+
+  // Set the texture wrapping/filtering options (on the currently bound texture object)
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+  // Trilinear over the uploaded chain; without immutable storage the
+  // texture is only complete once its last level is the chain's
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, chain.levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+  if (!storage)
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, chain.levels - 1);
+
+  // Generate texture from image, every level sourced from the mapping or
+  // the bound PBO
+  for (int level = 0; level < chain.levels; level++)
+  {
+    int width = mip_level_size(chain.width, level), height = mip_level_size(chain.height, level);
+    const void *offset = source ? (const void *)(source + chain.offsets[level]) : (const void *)chain.offsets[level];
+    GLsizei bytes = (GLsizei)mip_level_bytes(chain.format, width, height);
+    if (chain.format == MIP_FORMAT_RGBA8 && storage)
+      glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, offset);
+    else if (chain.format == MIP_FORMAT_RGBA8)
+      glTexImage2D(GL_TEXTURE_2D, level, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, offset);
+    else if (storage)
+      glCompressedTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, width, height, internal_format, bytes, offset);
+    else
+      glCompressedTexImage2D(GL_TEXTURE_2D, level, internal_format, width, height, 0, bytes, offset);
+  }
+  printf("Texture %s: %s, %zu bytes\n", upload->path.c_str(), mip_format_names[chain.format], size);
+  gl_state_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  // The GL has its own copy of client memory once the calls return
+  upload->chain = MipChain();
+  ktx2_close(upload->ktx);
+  upload->fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+GLuint texture_handle(int id)
+{
+  if (id < 0 || id >= (int)texture_loader.loads.size() || !texture_loader.loads[id].ready)
+    return texture_loader.placeholder;
+  return texture_loader.loads[id].texture;
+}
+
+void cull_report()
+{
+  if (!culling.frames)
+    return;
+  double visible = culling.visible_sum / culling.frames;
+  printf("Culling (%s): %.1f of %zu instances visible per frame, %.1f culled, %.3f ms culling\n",
+         cull_kernels().name, visible, instance_params.size(), instance_params.size() - visible,
+         culling.cull_ms_sum / culling.frames);
+}
+
+// Size the render target for the window; false if it can't be rendered to
+bool dynres_allocate(int width, int height)
+{
+  glBindRenderbuffer(GL_RENDERBUFFER, dynres.color);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, dynres.depth);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+  dynres.fbo_width = width;
+  dynres.fbo_height = height;
+  gl_state_bind_framebuffer(GL_FRAMEBUFFER, dynres.fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, dynres.color);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, dynres.depth);
+  GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+  gl_state_bind_framebuffer(GL_FRAMEBUFFER, 0);
+  if (status != GL_FRAMEBUFFER_COMPLETE)
+  {
+    fprintf(stderr, "ERROR: dynamic resolution framebuffer incomplete (0x%x)\n", status);
+    return false;
+  }
+  return true;
+}
+
+bool dynres_start()
+{
+  glGenFramebuffers(1, &dynres.fbo);
+  glGenRenderbuffers(1, &dynres.color);
+  glGenRenderbuffers(1, &dynres.depth);
+  glGenQueries(dynres_latency * 2, dynres.queries);
+  if (!dynres_allocate(gl_width, gl_height))
+  {
+    dynres_shutdown();
+    return false;
+  }
+  dynres.min_scale = std::min(std::max(dynres.min_scale, 0.1f), 1.0f);
+  printf("Dynamic resolution: %.2f ms GPU budget, scale down to %.2f\n", dynres.budget_ms, dynres.min_scale);
+  return true;
+}
+
+// Read the GPU time of a past frame and steer the scale with it
+void dynres_collect(int slot)
+{
+  if (!dynres.pending[slot])
+    return;
+  dynres.pending[slot] = false;
+  GLuint available = GL_FALSE;
+  glGetQueryObjectuiv(dynres.queries[slot * 2 + 1], GL_QUERY_RESULT_AVAILABLE, &available);
+  if (!available)
+  {
+    dynres.dropped++;
+    return;
+  }
+  GLuint64 begin, end;
+  glGetQueryObjectui64v(dynres.queries[slot * 2], GL_QUERY_RESULT, &begin);
+  glGetQueryObjectui64v(dynres.queries[slot * 2 + 1], GL_QUERY_RESULT, &end);
+  double ms = std::max((end - begin) / 1.0e6, dynres.cpu_ms[slot]);
+  float used = dynres.scales[slot];
+  dynres.measured++;
+  dynres.scale_sum += used;
+  dynres.cost_sum += ms;
+  dynres.scale_low = std::min(dynres.scale_low, used);
+  dynres.scale_high = std::max(dynres.scale_high, used);
+
+  float target = dynres.scale;
+  if (ms > 0.0)
+    target = used * (float)sqrt(dynres.budget_ms * dynres_headroom / ms);
+  target = std::min(std::max(target, dynres.min_scale), 1.0f);
+  if (ms > dynres.budget_ms)
+  {
+    dynres.over_budget++;
+    dynres.scale = std::min(dynres.scale, target);
+  }
+  else if (target > dynres.scale + dynres_dead_band)
+    dynres.scale = std::min(target, dynres.scale + dynres_step_up);
+}
+
+// Start of render(): the scene goes to the render target, at the scale
+// of this frame, with the scissor test keeping the clear inside it
+void dynres_begin_frame()
+{
+  if (!dynres.enabled)
+    return;
+  int slot = dynres.frame % dynres_latency;
+  dynres_collect(slot);
+  if ((dynres.fbo_width != gl_width || dynres.fbo_height != gl_height) && !dynres_allocate(gl_width, gl_height))
+  {
+    // Straight to the window from now on, as without --gpu-budget
+    fprintf(stderr, "ERROR: could not resize the render target to %dx%d, dynamic resolution off\n", gl_width,
+            gl_height);
+    dynres_shutdown();
+    return;
+  }
+
+  dynres.width = std::max(1, (int)(gl_width * dynres.scale + 0.5f));
+  dynres.height = std::max(1, (int)(gl_height * dynres.scale + 0.5f));
+  dynres.scales[slot] = dynres.scale;
+  dynres.cpu_start = std::chrono::steady_clock::now();
+  glQueryCounter(dynres.queries[slot * 2], GL_TIMESTAMP);
+  gl_state_bind_framebuffer(GL_FRAMEBUFFER, dynres.fbo);
+  glViewport(0, 0, dynres.width, dynres.height);
+  glScissor(0, 0, dynres.width, dynres.height);
+  glEnable(GL_SCISSOR_TEST);
+}
+
+// After the scene: upscale it to the window, which gets the rest of the
+// frame and is read back by the capture
+void dynres_resolve()
+{
+  if (!dynres.enabled)
+    return;
+  glDisable(GL_SCISSOR_TEST);
+  gl_state_bind_framebuffer(GL_DRAW_FRAMEBUFFER, 0);
+  glBlitFramebuffer(0, 0, dynres.width, dynres.height, 0, 0, gl_width, gl_height, GL_COLOR_BUFFER_BIT, GL_LINEAR);
+  gl_state_bind_framebuffer(GL_READ_FRAMEBUFFER, 0);
+  glViewport(0, 0, gl_width, gl_height);
+}
+
+void dynres_end_frame()
+{
+  if (!dynres.enabled)
+    return;
+  int slot = dynres.frame % dynres_latency;
+  glQueryCounter(dynres.queries[slot * 2 + 1], GL_TIMESTAMP);
+  dynres.cpu_ms[slot] =
+      std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - dynres.cpu_start).count();
+  dynres.pending[slot] = true;
+  dynres.frame++;
+}
+
+void dynres_shutdown()
+{
+  if (!dynres.fbo)
+    return;
+  if (dynres.measured)
+    printf("Dynamic resolution: scale %.2f mean (%.2f-%.2f), %.3f ms mean cost, %d of %d frames over %.2f ms, "
+           "%d dropped\n",
+           dynres.scale_sum / dynres.measured, dynres.scale_low, dynres.scale_high, dynres.cost_sum / dynres.measured,
+           dynres.over_budget, dynres.measured, dynres.budget_ms, dynres.dropped);
+  glDeleteQueries(dynres_latency * 2, dynres.queries);
+  glDeleteRenderbuffers(1, &dynres.color);
+  glDeleteRenderbuffers(1, &dynres.depth);
+  glDeleteFramebuffers(1, &dynres.fbo);
+  dynres.fbo = 0;
+  dynres.enabled = false;
+}
+
+// Parallel-for body: the matrices of a range of instances
+void animate_instances(void *data, size_t first, size_t count)
+{
+  glm::mat4 *models = culling.enabled ? &culling.models[0] : instance_models;
+  anim_kernels().models(instance_params, first, count, frame_time, (float *)(models + first));
+}
+
+// Parallel-for body, over the same chunks as the animation: the list of
+// the visible instances of a chunk
+void cull_instances(void *data, size_t first, size_t count)
+{
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  culling.counts[first / culling.grain] = (uint32_t)cull_kernels().spheres(
+      culling.frustum, culling.bounds, (const float *)&culling.models[first], count, (uint32_t)first,
+      &culling.visible[first]);
+  culling.cull_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start)
+                         .count();
+}
+
+// Parallel-for body, over chunks: their visible matrices, after the ones
+// of the chunks before them
+void compact_instances(void *data, size_t first, size_t count)
+{
+  size_t offset = 0;
+  for (size_t chunk = 0; chunk < first; chunk++)
+    offset += culling.counts[chunk];
+  for (size_t chunk = first; chunk < first + count; chunk++)
+  {
+    const uint32_t *visible = &culling.visible[chunk * culling.grain];
+    for (uint32_t i = 0; i < culling.counts[chunk]; i++)
+      instance_models[offset + i] = culling.models[visible[i]];
+    offset += culling.counts[chunk];
+  }
+}
+
+// One invocation per instance, gpu_cull_group_size per workgroup
+const char *gpu_cull_shader =
+    "#version 430\n"
+    "layout(local_size_x = 64) in;\n"
+    "layout(std430, binding = 0) readonly buffer Models { mat4 models[]; };\n" // The streaming buffer
+    "layout(std430, binding = 1) writeonly buffer Visible { mat4 visible[]; };\n"
+    "layout(std430, binding = 2) buffer Counter { uint num_visible; };\n"
+    "uniform vec4 planes[6];\n" // xyz: inward normal, w: distance
+    "uniform vec4 bounds;\n"    // Local bounding sphere: center, radius
+    "uniform uint first;\n"     // This frame's matrices in Models
+    "uniform uint count;\n"
+    "shared uint group_visible, group_first;\n"
+    "void main() {\n"
+    "  if (gl_LocalInvocationIndex == 0u)\n"
+    "    group_visible = 0u;\n"
+    "  barrier();\n"
+    "  uint i = gl_GlobalInvocationID.x;\n"
+    "  bool inside = i < count;\n"
+    "  mat4 model;\n"
+    "  uint slot;\n"
+    "  if (inside) {\n"
+    "    model = models[first + i];\n"
+    "    vec3 center = (model * vec4(bounds.xyz, 1.0)).xyz;\n"
+    "    for (int p = 0; p < 6; p++)\n"
+    "      inside = inside && dot(planes[p].xyz, center) + planes[p].w >= -bounds.w;\n"
+    "    if (inside)\n"
+    "      slot = atomicAdd(group_visible, 1u);\n"
+    "  }\n"
+    "  barrier();\n"
+    "  if (gl_LocalInvocationIndex == 0u)\n"
+    "    group_first = atomicAdd(num_visible, group_visible);\n"
+    "  barrier();\n"
+    "  if (inside)\n"
+    "    visible[group_first + slot] = model;\n"
+    "}\n";
+
+const char *gpu_cull_finalize_shader =
+    "#version 430\n"
+    "layout(local_size_x = 64) in;\n"
+    "struct Command { uint count, instance_count, first_index; int base_vertex; uint base_instance; };\n"
+    "layout(std430, binding = 2) buffer Counter { uint num_visible; };\n"
+    "layout(std430, binding = 3) buffer Commands { Command commands[]; };\n"
+    "uniform uint num_commands;\n"
+    "void main() {\n"
+    "  uint visible = num_visible;\n"
+    "  for (uint i = gl_LocalInvocationIndex; i < num_commands; i += 64u)\n"
+    "    commands[i].instance_count = visible;\n"
+    "  barrier();\n" // Everyone has read the counter
+    "  if (gl_LocalInvocationIndex == 0u)\n"
+    "    num_visible = 0u;\n"
+    "}\n";
+
+bool gpu_cull_start()
+{
+  // The shaders are GLSL 4.30
+  if (!GLEW_VERSION_4_3)
+  {
+    printf("Compute shaders not supported, culling on the CPU\n");
+    return false;
+  }
+  if (!build_compute_program(gpu_cull.cull, gpu_cull_shader) ||
+      !build_compute_program(gpu_cull.finalize, gpu_cull_finalize_shader))
+  {
+    gpu_cull_release();
+    printf("GPU culling unavailable, culling on the CPU\n");
+    return false;
+  }
+  gpu_cull.planes = get_uniform<GL_FLOAT_VEC4>(gpu_cull.cull, "planes");
+  gpu_cull.bounds = get_uniform<GL_FLOAT_VEC4>(gpu_cull.cull, "bounds");
+  gpu_cull.first = get_uniform<GL_UNSIGNED_INT>(gpu_cull.cull, "first");
+  gpu_cull.count = get_uniform<GL_UNSIGNED_INT>(gpu_cull.cull, "count");
+  gpu_cull.num_commands = get_uniform<GL_UNSIGNED_INT>(gpu_cull.finalize, "num_commands");
+  // More instances than that are culled by several dispatches
+  GLint max_groups = 65535; // the minimum the spec allows
+  glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_COUNT, 0, &max_groups);
+  gpu_cull.max_batch = (GLuint)std::min<GLuint64>((GLuint64)std::max(max_groups, 1) * gpu_cull_group_size, 1u << 30);
+
+  // Commands as the CPU would issue them, but for the instance count
+  std::vector<DrawElementsIndirectCommand> commands(mesh.ranges.size());
+  for (size_t i = 0; i < mesh.ranges.size(); i++)
+  {
+    const MeshRange &range = mesh.ranges[i];
+    DrawElementsIndirectCommand command = {(GLuint)range.count, 0, range.first, range.base_vertex, 0};
+    commands[i] = command;
+  }
+  GLuint zero = 0;
+  glGenBuffers(1, &gpu_cull.commands);
+  gl_state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, gpu_cull.commands);
+  glBufferData(GL_DRAW_INDIRECT_BUFFER, commands.size() * sizeof(DrawElementsIndirectCommand), commands.data(),
+               GL_STATIC_DRAW);
+  glGenBuffers(1, &gpu_cull.counter);
+  gl_state_bind_buffer(GL_SHADER_STORAGE_BUFFER, gpu_cull.counter);
+  glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), &zero, GL_DYNAMIC_COPY);
+  glGenBuffers(1, &gpu_cull.instances);
+  glGenBuffers(gpu_cull_latency, gpu_cull.readback);
+  for (int i = 0; i < gpu_cull_latency; i++)
+  {
+    gl_state_bind_buffer(GL_COPY_WRITE_BUFFER, gpu_cull.readback[i]);
+    glBufferData(GL_COPY_WRITE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_READ);
+  }
+  if (glGetError() != GL_NO_ERROR)
+  {
+    fprintf(stderr, "ERROR: could not create the GPU culling buffers\n");
+    gpu_cull_release();
+    printf("GPU culling unavailable, culling on the CPU\n");
+    return false;
+  }
+  printf("GPU culling: compute pass, %zu indirect draws\n", mesh.ranges.size());
+  return true;
+}
+
+// Whatever gpu_cull_start() got to create (deleting 0 does nothing)
+void gpu_cull_release()
+{
+  glDeleteProgram(gpu_cull.cull.id);
+  glDeleteProgram(gpu_cull.finalize.id);
+  gpu_cull.cull.id = 0;
+  gpu_cull.finalize.id = 0;
+  // Unbound through the tracker, or it would keep a deleted buffer bound
+  gl_state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, 0);
+  glDeleteBuffers(1, &gpu_cull.commands);
+  glDeleteBuffers(1, &gpu_cull.counter);
+  glDeleteBuffers(1, &gpu_cull.instances);
+  glDeleteBuffers(gpu_cull_latency, gpu_cull.readback);
+  gpu_cull.commands = 0;
+  gpu_cull.counter = 0;
+  gpu_cull.instances = 0;
+  for (int i = 0; i < gpu_cull_latency; i++)
+    gpu_cull.readback[i] = 0;
+}
+
+// Room for every instance, should all of them be visible
+void gpu_cull_resize(int instances)
+{
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, gpu_cull.instances);
+  glBufferData(GL_ARRAY_BUFFER, instances * sizeof(glm::mat4), NULL, GL_DYNAMIC_COPY);
+  for (int i = 0; i < gpu_cull_latency; i++)
+  {
+    if (gpu_cull.fences[i])
+      glDeleteSync(gpu_cull.fences[i]);
+    gpu_cull.fences[i] = 0;
+  }
+  gpu_cull.visible = -1;
+  gpu_cull.frames = 0;
+  gpu_cull.visible_sum = 0.0;
+}
+
+// Read the visible count of a past frame, unless the GPU isn't done with it
+void gpu_cull_collect(int slot)
+{
+  if (!gpu_cull.fences[slot])
+    return;
+  GLenum status = glClientWaitSync(gpu_cull.fences[slot], 0, 0);
+  if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+    return;
+  glDeleteSync(gpu_cull.fences[slot]);
+  gpu_cull.fences[slot] = 0;
+  GLuint visible;
+  gl_state_bind_buffer(GL_COPY_READ_BUFFER, gpu_cull.readback[slot]);
+  glGetBufferSubData(GL_COPY_READ_BUFFER, 0, sizeof(GLuint), &visible);
+  gpu_cull.visible = (int)visible;
+  gpu_cull.frames++;
+  gpu_cull.visible_sum += visible;
+}
+
+// In render(), once this frame's matrices are in the streaming buffer
+void gpu_cull_dispatch()
+{
+  GpuScope scope("gpu cull");
+  int slot = gpu_cull.frame++ % gpu_cull_latency;
+  gpu_cull_collect(slot);
+
+  glm::vec4 planes[frustum_planes];
+  for (int p = 0; p < frustum_planes; p++)
+    planes[p] = glm::vec4(culling.frustum.a[p], culling.frustum.b[p], culling.frustum.c[p], culling.frustum.d[p]);
+  glm::vec4 bounds(culling.bounds.x, culling.bounds.y, culling.bounds.z, culling.bounds.radius);
+  GLuint count = (GLuint)instance_params.size();
+  GLuint first = (GLuint)(instance_offset / sizeof(glm::mat4));
+  gl_state_use_program(gpu_cull.cull.id);
+  set_uniform(gpu_cull.planes, planes, frustum_planes);
+  set_uniform(gpu_cull.bounds, &bounds);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, instance_stream.buffer);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, gpu_cull.instances);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, gpu_cull.counter);
+  glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 3, gpu_cull.commands);
+  // The batches only share the counter, which they update atomically
+  for (GLuint done = 0; done < count; done += gpu_cull.max_batch)
+  {
+    GLuint batch = std::min(gpu_cull.max_batch, count - done);
+    set_uniform(gpu_cull.first, first + done);
+    set_uniform(gpu_cull.count, batch);
+    glDispatchCompute((batch + gpu_cull_group_size - 1) / gpu_cull_group_size, 1, 1);
+  }
+  glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+  gl_state_use_program(gpu_cull.finalize.id);
+  set_uniform(gpu_cull.num_commands, (GLuint)mesh.ranges.size());
+  glDispatchCompute(1, 1, 1);
+  // The draws read the commands and the matrices, the next frame's
+  // passes the counter
+  glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT |
+                  GL_BUFFER_UPDATE_BARRIER_BIT);
+
+  gl_state_bind_buffer(GL_COPY_READ_BUFFER, gpu_cull.commands);
+  gl_state_bind_buffer(GL_COPY_WRITE_BUFFER, gpu_cull.readback[slot]);
+  glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER,
+                      offsetof(DrawElementsIndirectCommand, instance_count), 0, sizeof(GLuint));
+  if (gpu_cull.fences[slot])
+    glDeleteSync(gpu_cull.fences[slot]);
+  gpu_cull.fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void gpu_cull_report()
+{
+  if (!gpu_cull.frames)
+    return;
+  double visible = gpu_cull.visible_sum / gpu_cull.frames;
+  printf("GPU culling: %.1f of %zu instances visible per frame (%ld frames read back), %.1f culled\n", visible,
+         instance_params.size(), gpu_cull.frames, instance_params.size() - visible);
+}
+
+// The cube field draw items, in the render queue for render() to flush
+void build_draw_lists(void *data, size_t first, size_t count)
+{
+  culling.num_visible = (int)instance_params.size();
+  if (culling.enabled)
+  {
+    culling.num_visible = 0;
+    for (size_t chunk = 0; chunk < culling.counts.size(); chunk++)
+      culling.num_visible += culling.counts[chunk];
+    culling.frames++;
+    culling.visible_sum += culling.num_visible;
+    culling.cull_ms_sum += culling.cull_ns / 1.0e6;
+  }
+
+  if (multi_draw)
+  {
+    DrawItem item = {};
+    item.name = "multi-draw";
+    item.program = frame_programs[0];
+    item.vao = vao;
+    item.texture = frame_texture;
+    item.depth_test = true;
+    item.indexed = true;
+    item.mode = GL_TRIANGLES;
+    item.indirect_buffer = gpu_cull.enabled ? gpu_cull.commands : draw_commands_buffer;
+    item.draw_count = (GLsizei)mesh.ranges.size();
+    queue_submit(render_queue, item, LAYER_OPAQUE, 0.0f);
+  }
+  for (size_t i = 0; !multi_draw && i < mesh.ranges.size(); i++)
+  {
+    const MeshRange &range = mesh.ranges[i];
+    DrawItem item = {};
+    item.name = range.textured ? "textured" : "untextured";
+    item.program = frame_programs[range.textured];
+    item.vao = vao;
+    item.texture = range.textured ? frame_texture : 0;
+    item.depth_test = true;
+    item.indexed = true;
+    item.mode = GL_TRIANGLES;
+    item.first = range.first;
+    item.base_vertex = range.base_vertex;
+    item.count = range.count;
+    item.instances = culling.num_visible;
+    if (gpu_cull.enabled)
+    {
+      // This range's command, on its own
+      item.first = (GLint)(i * sizeof(DrawElementsIndirectCommand));
+      item.indirect_buffer = gpu_cull.commands;
+      item.draw_count = 1;
+    }
+    queue_submit(render_queue, item, LAYER_OPAQUE, 0.0f);
+  }
+}
+
+// Start the frame graph: animate every instance (the spinning cube
+// movement, shifted in time by the instance phase, around the instance
+// position in the grid) in parallel, cull and compact them, then build
+// the draw lists. animbench compares the batch kernels with a glm chain
+// per instance
+void update(double currentTime)
+{
+  job_begin_frame();
+  update_camera_matrices();
+  culling.frustum = frustum_from_matrix(glm::value_ptr(camera.projection * camera.view));
+  stream_begin_frame(instance_stream);
+  instance_models = (glm::mat4 *)stream_alloc(instance_stream, instance_params.size() * sizeof(glm::mat4),
+                                              sizeof(glm::mat4), &instance_offset);
+  frame_time = (float)currentTime;
+
+  unsigned features = FEATURE_INSTANCED | (lighting ? FEATURE_LIT : 0);
+  if (multi_draw)
+    frame_programs[0] =
+        get_shader_variant(features | FEATURE_TEXTURED | FEATURE_VERTEX_COLOR | FEATURE_MULTI_DRAW)->program.id;
+  else
+  {
+    frame_programs[0] = get_shader_variant(features | FEATURE_VERTEX_COLOR)->program.id;
+    frame_programs[1] = get_shader_variant(features | FEATURE_TEXTURED)->program.id;
+  }
+  frame_texture = texture_handle(texture);
+  frame_job = NULL;
+  if (!instance_models)
+    return; // No cubes this frame
+
+  // A few chunks per worker, whole SIMD batches
+  size_t grain = instance_params.size() / (job_system().queues.size() * 4);
+  grain = std::max<size_t>((grain + 7) & ~(size_t)7, 1024);
+  Job *animate = job_parallel_for("animate", animate_instances, NULL, instance_params.size(), grain);
+  Job *draw_lists = job_create("draw lists", build_draw_lists, NULL);
+  if (culling.enabled)
+  {
+    culling.grain = grain;
+    culling.counts.resize((instance_params.size() + grain - 1) / grain);
+    culling.cull_ns = 0;
+    Job *cull = job_parallel_for("cull", cull_instances, NULL, instance_params.size(), grain);
+    Job *compact = job_parallel_for("compact", compact_instances, NULL, culling.counts.size(),
+                                    culling.counts.size() / (job_system().queues.size() * 4));
+    job_depends(cull, animate);
+    job_depends(compact, cull);
+    job_depends(draw_lists, compact);
+    job_submit(draw_lists);
+    job_submit(compact);
+    job_submit(cull);
+  }
+  else
+  {
+    job_depends(draw_lists, animate);
+    job_submit(draw_lists);
+  }
+  job_submit(animate);
+  frame_job = draw_lists;
+}
+
+// Before the frame graph starts, which culls with them
+void update_camera_matrices()
+{
+  if (!camera_dirty)
+    return;
+  // Configuraciones de la matriz de vista/proyección
+  camera.view = glm::mat4(1.0f);
+  camera.projection = glm::perspective(glm::radians(50.0f), (float)gl_width / (float)gl_height, 0.1f, 1000.0f); // Cambiar a radians a 10.0f para ver mas de cerca
+  camera.viewport = glm::vec4(0.0f, 0.0f, (float)gl_width, (float)gl_height);
+}
+
+void update_camera(double currentTime)
+{
+  camera.time = (float)currentTime;
+  camera_dirty = false;
+  stream_begin_frame(camera_stream);
+  GLintptr offset = 0;
+  void *block = stream_alloc(camera_stream, sizeof(CameraBlock), camera_block_size, &offset);
+  if (!block)
+    return; // Only with a region smaller than the block, the last one stays bound
+  memcpy(block, &camera, sizeof(CameraBlock));
+  stream_flush(camera_stream);
+  // The range binding moves the generic binding too
+  gl_state_bind_buffer(GL_UNIFORM_BUFFER, camera_stream.buffer);
+  glBindBufferRange(GL_UNIFORM_BUFFER, camera_binding, camera_stream.buffer, offset, sizeof(CameraBlock));
+}
+
+void render(double currentTime)
+{
+  gpu_profiler_begin_frame();
+  int frame_scope = gpu_profiler_begin("frame");
+
+  dynres_begin_frame();
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+  // Sube las texturas ya decodificadas
+  texture_loader_update();
+
+  // Cámara (vista/proyección) compartida por todos los programas
+  update_camera(currentTime);
+
+  // Espera a los trabajos del frame: matrices de modelo de todas las
+  // instancias, ya escritas en la región de este frame, y la lista de
+  // dibujado del cubo (la cara texturizada y el resto, para todas las
+  // instancias a la vez) ya en la cola
+  if (frame_job)
+  {
+    job_wait(frame_job);
+    stream_flush(instance_stream);
+    if (multi_draw && culling.num_visible != culling.drawn)
+      update_draw_commands(culling.num_visible);
+    if (gpu_cull.enabled)
+      gpu_cull_dispatch();
+
+    // The matrices of the visible instances, compacted by the GPU, or the
+    // ones in the streaming buffer
+    GLuint instances = gpu_cull.enabled ? gpu_cull.instances : instance_stream.buffer;
+    GLintptr offset = gpu_cull.enabled ? 0 : instance_offset;
+    gl_state_bind_vertex_array(vao);
+    gl_state_bind_buffer(GL_ARRAY_BUFFER, instances);
+    for (int column = 0; column < 4; column++)
+      glVertexAttribPointer(3 + column, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                            (void *)(offset + column * sizeof(glm::vec4)));
+  }
+
+  queue_flush(render_queue);
+  draw_calls = render_queue.draw_calls;
+  state_changes = render_queue.state_changes;
+
+  // The HUD goes on top of the upscaled scene, at the window resolution
+  dynres_resolve();
+  if (hud_enabled)
+  {
+    submit_hud();
+    queue_flush(render_queue);
+    draw_calls += render_queue.draw_calls;
+    state_changes += render_queue.state_changes;
+  }
+
+  stream_end_frame(instance_stream);
+  stream_end_frame(camera_stream);
+  if (hud_enabled)
+    stream_end_frame(hud_stream);
+  dynres_end_frame();
+
+  if (frame_capture().enabled)
+  {
+    int capture_scope = gpu_profiler_begin("capture");
+    capture_frame(gl_width, gl_height);
+    gpu_profiler_end(capture_scope);
+  }
+
+  gl_state_end_frame();
+  gpu_profiler_end(frame_scope);
+  gpu_profiler_end_frame();
+}
+
+void mesh_begin_range(MeshBuilder &builder, bool textured)
+{
+  MeshRange range = {(GLuint)builder.mesh.indices.size(), 0, 0, textured};
+  builder.mesh.ranges.push_back(range);
+}
+
+// Vertices come in triangle order; repeated ones only add an index
+void mesh_add_vertex(MeshBuilder &builder, const MeshVertex &v)
+{
+  if (builder.mesh.ranges.empty())
+    mesh_begin_range(builder, false);
+
+  // Compared bytewise, so turn -0.0 into 0.0 first
+  MeshVertex vertex = v;
+  float *components = &vertex.position.x;
+  for (size_t i = 0; i < sizeof(MeshVertex) / sizeof(float); i++)
+    components[i] += 0.0f;
+
+  std::string key((const char *)&vertex, sizeof(vertex));
+  GLuint index = (GLuint)builder.mesh.vertices.size();
+  std::pair<std::unordered_map<std::string, GLuint>::iterator, bool> found =
+      builder.unique.insert(std::make_pair(key, index));
+  if (found.second)
+    builder.mesh.vertices.push_back(vertex);
+  else
+    index = found.first->second;
+
+  builder.mesh.indices.push_back(index);
+  builder.mesh.ranges.back().count++;
+}
+
+// Average cache miss ratio (transformed vertices per triangle) with a FIFO
+// post-transform cache, a proxy for vertex shader invocations
+float mesh_acmr(const Mesh &mesh, int cache_size)
+{
+  if (mesh.indices.empty())
+    return 0.0f;
+
+  std::vector<int> cached_at(mesh.vertices.size(), -cache_size - 1);
+  int misses = 0;
+  for (size_t i = 0; i < mesh.indices.size(); i++)
+  {
+    GLuint v = mesh.indices[i];
+    if (misses - cached_at[v] > cache_size)
+      cached_at[v] = misses++;
+  }
+  return misses / (mesh.indices.size() / 3.0f);
+}
+
+// Tom Forsyth's "Linear-speed vertex cache optimisation" scoring
+const int forsyth_cache_size = 32;
+
+float forsyth_score(int cache_position, int remaining_triangles)
+{
+  if (remaining_triangles == 0)
+    return -1.0f;
+
+  float score = 0.0f;
+  if (cache_position >= 0)
+  {
+    if (cache_position < 3)
+      score = 0.75f; // just used, avoid strips that double back on themselves
+    else
+      score = powf(1.0f - (cache_position - 3) * (1.0f / (forsyth_cache_size - 3)), 1.5f);
+  }
+  // Favour vertices with few triangles left, so they leave the cache for good
+  return score + 2.0f * powf((float)remaining_triangles, -0.5f);
+}
+
+// Reorder the triangles of [first, first + count) for vertex cache reuse
+void optimize_range(std::vector<GLuint> &indices, GLuint first, GLsizei count, size_t num_vertices)
+{
+  size_t num_triangles = count / 3;
+  const GLuint *tri_indices = &indices[first];
+
+  // Triangles using every vertex
+  std::vector<int> remaining(num_vertices, 0), adjacency_start(num_vertices + 1, 0);
+  for (GLsizei i = 0; i < count; i++)
+    remaining[tri_indices[i]]++;
+  for (size_t v = 0; v < num_vertices; v++)
+    adjacency_start[v + 1] = adjacency_start[v] + remaining[v];
+  std::vector<int> adjacency(count), fill(adjacency_start.begin(), adjacency_start.end() - 1);
+  for (GLsizei i = 0; i < count; i++)
+    adjacency[fill[tri_indices[i]]++] = i / 3;
+
+  std::vector<int> cache_position(num_vertices, -1);
+  std::vector<float> vertex_score(num_vertices), triangle_score(num_triangles, 0.0f);
+  std::vector<bool> emitted(num_triangles, false);
+  for (size_t v = 0; v < num_vertices; v++)
+    vertex_score[v] = forsyth_score(-1, remaining[v]);
+  for (size_t t = 0; t < num_triangles; t++)
+    for (int k = 0; k < 3; k++)
+      triangle_score[t] += vertex_score[tri_indices[t * 3 + k]];
+
+  std::vector<GLuint> output;
+  output.reserve(count);
+  std::vector<GLuint> cache, new_cache;
+  size_t scan = 0;
+  int best = -1;
+  while (output.size() < (size_t)count)
+  {
+    if (best < 0)
+    {
+      // Nothing useful in the cache: next triangle in the original order
+      while (emitted[scan])
+        scan++;
+      best = (int)scan;
+    }
+
+    emitted[best] = true;
+    new_cache.clear();
+    for (int k = 0; k < 3; k++)
+    {
+      GLuint v = tri_indices[best * 3 + k];
+      output.push_back(v);
+      new_cache.push_back(v);
+      // Drop the triangle from the vertex adjacency list
+      int *begin = &adjacency[adjacency_start[v]];
+      int *end = begin + remaining[v];
+      *std::find(begin, end, best) = *(end - 1);
+      remaining[v]--;
+    }
+    for (size_t i = 0; i < cache.size(); i++)
+      if (std::find(new_cache.begin(), new_cache.begin() + 3, cache[i]) == new_cache.begin() + 3)
+        new_cache.push_back(cache[i]);
+    // Vertices pushed out of the cache
+    for (size_t i = forsyth_cache_size; i < new_cache.size(); i++)
+      cache_position[new_cache[i]] = -1;
+    if (new_cache.size() > (size_t)forsyth_cache_size)
+      new_cache.resize(forsyth_cache_size);
+    cache.swap(new_cache);
+
+    // Rescore the cached vertices and their triangles, pick the best one
+    best = -1;
+    float best_score = -1.0f;
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+      GLuint v = cache[i];
+      cache_position[v] = (int)i;
+      float score = forsyth_score((int)i, remaining[v]);
+      float delta = score - vertex_score[v];
+      vertex_score[v] = score;
+      for (int j = 0; j < remaining[v]; j++)
+        triangle_score[adjacency[adjacency_start[v] + j]] += delta;
+    }
+    for (size_t i = 0; i < cache.size(); i++)
+    {
+      GLuint v = cache[i];
+      for (int j = 0; j < remaining[v]; j++)
+      {
+        int t = adjacency[adjacency_start[v] + j];
+        if (triangle_score[t] > best_score)
+        {
+          best_score = triangle_score[t];
+          best = t;
+        }
+      }
+    }
+  }
+
+  std::copy(output.begin(), output.end(), indices.begin() + first);
+}
+
+// Optimize triangle order per range, then renumber the vertices in order
+// of first use so the vertex fetches walk the buffer linearly
+void mesh_optimize(Mesh &mesh)
+{
+  for (size_t i = 0; i < mesh.ranges.size(); i++)
+    optimize_range(mesh.indices, mesh.ranges[i].first, mesh.ranges[i].count, mesh.vertices.size());
+
+  std::vector<GLuint> remap(mesh.vertices.size(), ~0u);
+  std::vector<MeshVertex> vertices;
+  vertices.reserve(mesh.vertices.size());
+  for (size_t i = 0; i < mesh.indices.size(); i++)
+  {
+    GLuint &index = mesh.indices[i];
+    if (remap[index] == ~0u)
+    {
+      remap[index] = (GLuint)vertices.size();
+      vertices.push_back(mesh.vertices[index]);
+    }
+    index = remap[index];
+  }
+  mesh.vertices.swap(vertices);
+}
+
+// Add a mesh to the shared buffers; its indices are kept as they are and
+// its ranges get the vertex offset as base vertex
+void mesh_append(Mesh &pool, const Mesh &mesh)
+{
+  GLuint first = (GLuint)pool.indices.size();
+  GLint base_vertex = (GLint)pool.vertices.size();
+  pool.vertices.insert(pool.vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+  pool.indices.insert(pool.indices.end(), mesh.indices.begin(), mesh.indices.end());
+  for (size_t i = 0; i < mesh.ranges.size(); i++)
+  {
+    MeshRange range = mesh.ranges[i];
+    range.first += first;
+    range.base_vertex += base_vertex;
+    pool.ranges.push_back(range);
+  }
+}
+
+// Wavefront OBJ: positions, texture coords and normals, polygons are
+// triangulated as fans. The mesh is centered and scaled to the cube size
+bool load_obj(const char *path, MeshBuilder &builder)
+{
+  FILE *f = fopen(path, "r");
+  if (!f)
+  {
+    fprintf(stderr, "ERROR: could not open mesh '%s'\n", path);
+    return false;
+  }
+
+  std::vector<glm::vec3> positions, normals;
+  std::vector<glm::vec2> uvs;
+  glm::vec3 lo(1e30f), hi(-1e30f);
+  std::vector<std::vector<int> > faces; // position/uv/normal index triplets
+  char line[1024];
+  while (fgets(line, sizeof(line), f))
+  {
+    float x, y, z;
+    if (sscanf(line, "v %f %f %f", &x, &y, &z) == 3)
+    {
+      positions.push_back(glm::vec3(x, y, z));
+      lo = glm::min(lo, positions.back());
+      hi = glm::max(hi, positions.back());
+    }
+    else if (sscanf(line, "vt %f %f", &x, &y) == 2)
+      uvs.push_back(glm::vec2(x, y));
+    else if (sscanf(line, "vn %f %f %f", &x, &y, &z) == 3)
+      normals.push_back(glm::normalize(glm::vec3(x, y, z)));
+    else if (line[0] == 'f' && line[1] == ' ')
+    {
+      std::vector<int> face;
+      for (char *token = strtok(line + 2, " \t\r\n"); token; token = strtok(NULL, " \t\r\n"))
+      {
+        int index[3] = {0, 0, 0};
+        char *field = token;
+        for (int k = 0; k < 3 && field; k++)
+        {
+          if (*field && *field != '/')
+            index[k] = atoi(field);
+          field = strchr(field, '/');
+          if (field)
+            field++;
+        }
+        // Negative indices are relative to the end of the lists
+        int sizes[3] = {(int)positions.size(), (int)uvs.size(), (int)normals.size()};
+        for (int k = 0; k < 3; k++)
+          face.push_back(index[k] < 0 ? sizes[k] + index[k] : index[k] - 1);
+      }
+      faces.push_back(face);
+    }
+  }
+  fclose(f);
+
+  glm::vec3 center = (lo + hi) * 0.5f;
+  glm::vec3 extent = hi - lo;
+  float scale = 0.5f / std::max(extent.x, std::max(extent.y, extent.z));
+  for (size_t i = 0; i < faces.size(); i++)
+  {
+    const std::vector<int> &face = faces[i];
+    size_t corners = face.size() / 3;
+    for (size_t c = 1; c + 1 < corners; c++)
+    {
+      size_t fan[3] = {0, c, c + 1};
+      glm::vec3 p[3];
+      for (int k = 0; k < 3; k++)
+      {
+        int pi = face[fan[k] * 3];
+        if (pi < 0 || pi >= (int)positions.size())
+        {
+          fprintf(stderr, "ERROR: bad vertex index in '%s'\n", path);
+          return false;
+        }
+        p[k] = (positions[pi] - center) * scale;
+      }
+      glm::vec3 face_normal = glm::normalize(glm::cross(p[1] - p[0], p[2] - p[0]));
+      for (int k = 0; k < 3; k++)
+      {
+        int ti = face[fan[k] * 3 + 1], ni = face[fan[k] * 3 + 2];
+        MeshVertex vertex;
+        vertex.position = p[k];
+        vertex.uv = ti >= 0 && ti < (int)uvs.size() ? uvs[ti] : glm::vec2(0.0f);
+        vertex.normal = ni >= 0 && ni < (int)normals.size() ? normals[ni] : face_normal;
+        mesh_add_vertex(builder, vertex);
+      }
+    }
+  }
+  return !builder.mesh.indices.empty();
+}
+
+// Uber-shader source for the variants; shader_variant_source() puts the
+// feature #defines right after the #version line
+const char *variant_vertex_shader =
+    "#version 140\n"
+    "#ifdef MULTI_DRAW\n"
+    "#extension GL_ARB_shader_draw_parameters : require\n"
+    "flat out int draw_id;\n"
+    "#endif\n"
+    "in vec4 v_pos;\n"
+    "#ifdef TEXTURED\n"
+    "in vec2 texCoord;\n"      // Added texture coordinate input
+    "out vec2 fragTexCoord;\n" // Pass texture coordinate to fragment shader
+    "#endif\n"
+    "#ifdef VERTEX_COLOR\n"
+    "out vec4 vs_color;\n"
+    "#endif\n"
+    "#ifdef LIT\n"
+    "in vec3 v_normal;\n"
+    "out vec3 normal;\n" // In view space
+    "#endif\n"
+    "#ifdef INSTANCED\n"
+    "in mat4 instance_model;\n" // Per-instance model matrix
+    "#else\n"
+    "uniform mat4 model_matrix;\n"
+    "#endif\n"
+    "layout(std140) uniform Camera {\n" // Shared by all programs
+    "  mat4 view;\n"
+    "  mat4 projection;\n"
+    "  vec4 viewport;\n"
+    "  float time;\n"
+    "};\n"
+    "void main() {\n"
+    "#ifdef INSTANCED\n"
+    "  mat4 model = instance_model;\n"
+    "#else\n"
+    "  mat4 model = model_matrix;\n"
+    "#endif\n"
+    "  gl_Position = projection * view * model * v_pos;\n"
+    "#ifdef MULTI_DRAW\n"
+    "  draw_id = gl_DrawIDARB;\n"
+    "#endif\n"
+    "#ifdef TEXTURED\n"
+    "  fragTexCoord = texCoord;\n" // Pass texture coordinate
+    "#endif\n"
+    "#ifdef VERTEX_COLOR\n"
+    "  vs_color = v_pos * 2.0 + vec4(0.4, 0.4, 0.4, 0.0);\n"
+    "#endif\n"
+    "#ifdef LIT\n"
+    "  normal = mat3(view * model) * v_normal;\n" // No scaling in model matrices
+    "#endif\n"
+    "}\n";
+
+const char *variant_fragment_shader =
+    "#version 140\n"
+    "out vec4 frag_color;\n"
+    "#ifdef TEXTURED\n"
+    "in vec2 fragTexCoord;\n" // Received texture coordinate
+    "uniform sampler2D tex;\n" // Texture sampler
+    "#endif\n"
+    "#ifdef VERTEX_COLOR\n"
+    "in vec4 vs_color;\n"
+    "#endif\n"
+    "#ifdef LIT\n"
+    "in vec3 normal;\n"
+    "#endif\n"
+    "#ifdef MULTI_DRAW\n"
+    "flat in int draw_id;\n"
+    "layout(std140) uniform Materials {\n"
+    "  vec4 materials[256];\n" // x: texture weight, y: vertex color weight
+    "};\n"
+    "#endif\n"
+    "void main() {\n"
+    "  vec4 color = vec4(1.0);\n"
+    "#ifdef MULTI_DRAW\n"
+    "  vec4 material = materials[draw_id];\n"
+    "#else\n"
+    "  vec4 material = vec4(1.0);\n" // Folded away by the compiler
+    "#endif\n"
+    "#ifdef TEXTURED\n"
+    "  color *= mix(vec4(1.0), texture(tex, fragTexCoord), material.x);\n" // Apply texture
+    "#endif\n"
+    "#ifdef VERTEX_COLOR\n"
+    "  color *= mix(vec4(1.0), vs_color, material.y);\n"
+    "#endif\n"
+    "#ifdef LIT\n"
+    "  float diffuse = max(dot(normalize(normal), vec3(-0.36, 0.54, 0.76)), 0.0);\n" // Light from the upper left
+    "  color.rgb *= 0.3 + 0.7 * diffuse;\n"
+    "#endif\n"
+    "  frag_color = color;\n"
+    "}\n";
+
+std::string shader_variant_source(const char *source, unsigned features)
+{
+  const char *body = strchr(source, '\n') + 1;
+  std::string result(source, body);
+  for (int i = 0; i < NUM_SHADER_FEATURES; i++)
+    if (features & (1u << i))
+      result += std::string("#define ") + shader_feature_defines[i] + "\n";
+  return result + body;
+}
+
+ShaderVariant *get_shader_variant(unsigned features)
+{
+  std::unordered_map<unsigned, ShaderVariant>::iterator found = shader_variants.find(features);
+  if (found != shader_variants.end())
+    return &found->second;
+
+  ShaderVariant &variant = shader_variants[features];
+  std::string vertex_source = shader_variant_source(variant_vertex_shader, features);
+  std::string fragment_source = shader_variant_source(variant_fragment_shader, features);
+
+  // Fixed locations for the attributes set up in the VAO (instance_model
+  // takes locations 3 to 6)
+  const char *attributes[] = {"v_pos", "texCoord", "v_normal", "instance_model", NULL};
+  if (!build_program(variant.program, vertex_source.c_str(), fragment_source.c_str(), attributes) ||
+      !bind_uniform_block(variant.program, "Camera", camera_binding, sizeof(CameraBlock)) ||
+      ((features & FEATURE_MULTI_DRAW) &&
+       !bind_uniform_block(variant.program, "Materials", material_binding, sizeof(MaterialBlock))))
+  {
+    shader_variants.erase(features);
+    return NULL;
+  }
+
+  if (!(features & FEATURE_INSTANCED))
+    variant.model = get_uniform<GL_FLOAT_MAT4>(variant.program, "model_matrix");
+  if (features & FEATURE_TEXTURED)
+  {
+    gl_state_use_program(variant.program.id);
+    set_uniform(get_uniform<GL_SAMPLER_2D>(variant.program, "tex"), 0);
+  }
+
+  printf("Shader variant 0x%x:", features);
+  for (int i = 0; i < NUM_SHADER_FEATURES; i++)
+    if (features & (1u << i))
+      printf(" %s", shader_feature_defines[i]);
+  printf("\n");
+  return &variant;
+}
+
+// 64-bit FNV-1a, chained through 'hash' to cover several strings
+uint64_t fnv1a(const char *str, uint64_t hash = 14695981039346656037ULL)
+{
+  for (; *str; str++)
+  {
+    hash ^= (unsigned char)*str;
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ 0xff; // string separator
+}
+
+GLuint compile_shader(GLenum type, const char *source)
+{
+  GLuint shader = glCreateShader(type);
+  glShaderSource(shader, 1, &source, NULL);
+  glCompileShader(shader);
+
+  GLint status;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (!status)
+  {
+    char log[1024];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    fprintf(stderr, "ERROR: %s shader compilation failed:\n%s\n",
+            type == GL_VERTEX_SHADER ? "vertex" : type == GL_COMPUTE_SHADER ? "compute" : "fragment", log);
+    glDeleteShader(shader);
+    return 0;
+  }
+  return shader;
+}
+
+bool program_linked(GLuint program, bool report)
+{
+  GLint status;
+  glGetProgramiv(program, GL_LINK_STATUS, &status);
+  if (!status && report)
+  {
+    char log[1024];
+    glGetProgramInfoLog(program, sizeof(log), NULL, log);
+    fprintf(stderr, "ERROR: program link failed:\n%s\n", log);
+  }
+  return status;
+}
+
+// Cache file layout: magic, binary format, binary length, binary
+const uint32_t program_cache_magic = 0x4e425043; // "CPBN"
+
+bool load_program_binary(GLuint program, const char *path)
+{
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+
+  uint32_t header[3];
+  bool ok = fread(header, sizeof(header), 1, f) == 1 && header[0] == program_cache_magic;
+  // A truncated or corrupt file is just a miss, the length must be what's
+  // left of it
+  long start = ftell(f);
+  ok = ok && fseek(f, 0, SEEK_END) == 0 && ftell(f) - start == (long)header[2] && fseek(f, start, SEEK_SET) == 0;
+  std::vector<char> binary;
+  if (ok)
+  {
+    binary.resize(header[2]);
+    ok = fread(binary.data(), 1, binary.size(), f) == binary.size();
+  }
+  fclose(f);
+
+  if (ok)
+  {
+    glProgramBinary(program, header[1], binary.data(), (GLsizei)binary.size());
+    // The driver rejects binaries from other driver builds or hardware
+    ok = program_linked(program, false);
+  }
+  return ok;
+}
+
+void save_program_binary(GLuint program, const char *path)
+{
+  GLint length = 0;
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+  if (length <= 0)
+    return;
+
+  std::vector<char> binary(length);
+  GLenum format;
+  glGetProgramBinary(program, length, &length, &format, binary.data());
+
+  mkdir(shader_cache_dir, 0755);
+  FILE *f = fopen(path, "wb");
+  if (!f)
+  {
+    fprintf(stderr, "WARNING: could not write program cache '%s'\n", path);
+    return;
+  }
+  uint32_t header[3] = {program_cache_magic, format, (uint32_t)length};
+  fwrite(header, sizeof(header), 1, f);
+  fwrite(binary.data(), 1, length, f);
+  fclose(f);
+}
+
+// Create a program from its vertex and fragment shader sources. attributes
+// is a NULL-terminated list of attribute names bound to locations 0, 1...
+// When the driver supports program binaries, the linked program is stored
+// in shader_cache_dir and reused on the next start; any mismatch (sources,
+// driver) falls back to compilation
+bool build_program(ShaderProgram &program, const char *vertex_source, const char *fragment_source,
+                   const char *const *attributes)
+{
+  program.id = glCreateProgram();
+
+  GLint num_formats = 0;
+  if (GLEW_ARB_get_program_binary)
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+  bool use_cache = shader_cache_dir && num_formats > 0;
+
+  char cache_path[512] = "";
+  if (use_cache)
+  {
+    uint64_t hash = fnv1a(vertex_source);
+    hash = fnv1a(fragment_source, hash);
+    for (int i = 0; attributes[i]; i++)
+      hash = fnv1a(attributes[i], hash);
+    hash = fnv1a((const char *)glGetString(GL_VENDOR), hash);
+    hash = fnv1a((const char *)glGetString(GL_RENDERER), hash);
+    hash = fnv1a((const char *)glGetString(GL_VERSION), hash);
+    snprintf(cache_path, sizeof(cache_path), "%s/%016llx.bin", shader_cache_dir, (unsigned long long)hash);
+
+    if (load_program_binary(program.id, cache_path))
+    {
+      printf("Program %u loaded from %s\n", program.id, cache_path);
+      reflect_program(program);
+      return true;
+    }
+  }
+
+  GLuint vs = compile_shader(GL_VERTEX_SHADER, vertex_source);
+  GLuint fs = compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+  if (!vs || !fs)
+  {
+    glDeleteShader(vs);
+    glDeleteShader(fs);
+    return false;
+  }
+
+  // Attach shaders to the program and link it
+  glAttachShader(program.id, fs);
+  glAttachShader(program.id, vs);
+  for (int i = 0; attributes[i]; i++)
+    glBindAttribLocation(program.id, i, attributes[i]);
+  if (use_cache)
+    glProgramParameteri(program.id, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+  glLinkProgram(program.id);
+
+  // Release shader objects
+  glDetachShader(program.id, vs);
+  glDetachShader(program.id, fs);
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+
+  if (!program_linked(program.id, true))
+    return false;
+
+  if (use_cache)
+    save_program_binary(program.id, cache_path);
+  reflect_program(program);
+  return true;
+}
+
+bool build_compute_program(ShaderProgram &program, const char *source)
+{
+  GLuint cs = compile_shader(GL_COMPUTE_SHADER, source);
+  if (!cs)
+    return false;
+  program.id = glCreateProgram();
+  glAttachShader(program.id, cs);
+  glLinkProgram(program.id);
+  glDetachShader(program.id, cs);
+  glDeleteShader(cs);
+  if (!program_linked(program.id, true))
+    return false;
+  reflect_program(program);
+  return true;
+}
+
+// Query every active uniform and attribute of a linked program
+void reflect_program(ShaderProgram &program)
+{
+  GLint count = 0, max_length = 0;
+  program.uniforms.clear();
+  program.attributes.clear();
+  program.blocks.clear();
+
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_MAX_LENGTH, &max_length);
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORMS, &count);
+  std::vector<GLchar> name(std::max(max_length, 1));
+  for (GLint i = 0; i < count; i++)
+  {
+    ProgramVariable variable;
+    glGetActiveUniform(program.id, i, (GLsizei)name.size(), NULL, &variable.size, &variable.type, name.data());
+    variable.name = name.data();
+    // Arrays are reported as "name[0]"
+    size_t bracket = variable.name.find('[');
+    if (bracket != std::string::npos)
+      variable.name.resize(bracket);
+    variable.location = glGetUniformLocation(program.id, name.data());
+    program.uniforms.push_back(variable);
+  }
+
+  glGetProgramiv(program.id, GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &max_length);
+  glGetProgramiv(program.id, GL_ACTIVE_ATTRIBUTES, &count);
+  name.resize(std::max(max_length, 1));
+  for (GLint i = 0; i < count; i++)
+  {
+    ProgramVariable variable;
+    glGetActiveAttrib(program.id, i, (GLsizei)name.size(), NULL, &variable.size, &variable.type, name.data());
+    variable.name = name.data();
+    variable.location = glGetAttribLocation(program.id, name.data());
+    program.attributes.push_back(variable);
+  }
+
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCK_MAX_NAME_LENGTH, &max_length);
+  glGetProgramiv(program.id, GL_ACTIVE_UNIFORM_BLOCKS, &count);
+  name.resize(std::max(max_length, 1));
+  for (GLint i = 0; i < count; i++)
+  {
+    UniformBlock block;
+    glGetActiveUniformBlockName(program.id, i, (GLsizei)name.size(), NULL, name.data());
+    block.name = name.data();
+    block.index = i;
+    glGetActiveUniformBlockiv(program.id, i, GL_UNIFORM_BLOCK_DATA_SIZE, &block.data_size);
+    program.blocks.push_back(block);
+  }
+
+  printf("Program %u: %zu active uniforms, %zu active attributes, %zu uniform blocks\n",
+         program.id, program.uniforms.size(), program.attributes.size(), program.blocks.size());
+}
+
+// Attach a uniform block to a binding point, checking that its std140
+// layout matches the size of the C++ struct that feeds it
+bool bind_uniform_block(const ShaderProgram &program, const char *name, GLuint binding, GLint data_size)
+{
+  for (size_t i = 0; i < program.blocks.size(); i++)
+  {
+    const UniformBlock &block = program.blocks[i];
+    if (block.name != name)
+      continue;
+    if (block.data_size != data_size)
+    {
+      fprintf(stderr, "ERROR: uniform block '%s' is %d bytes, expected %d\n", name, block.data_size, data_size);
+      return false;
+    }
+    glUniformBlockBinding(program.id, block.index, binding);
+    return true;
+  }
+  fprintf(stderr, "WARNING: uniform block '%s' is not active in program %u\n", name, program.id);
+  return true;
+}
+
+// Look up a reflected uniform by name (only at setup time). Missing
+// uniforms, i.e. optimized out by the compiler, get location -1 so setting
+// them is a no-op, as with glGetUniformLocation
+const ProgramVariable *find_uniform(const ShaderProgram &program, const char *name, GLenum type)
+{
+  for (size_t i = 0; i < program.uniforms.size(); i++)
+  {
+    const ProgramVariable &variable = program.uniforms[i];
+    if (variable.name != name)
+      continue;
+    if (variable.type != type)
+    {
+      fprintf(stderr, "WARNING: uniform '%s' has type 0x%x, not 0x%x\n", name, variable.type, type);
+      return NULL;
+    }
+    return &variable;
+  }
+  fprintf(stderr, "WARNING: uniform '%s' is not active in program %u\n", name, program.id);
+  return NULL;
+}
+
+void processInput(GLFWwindow *window)
+{
+  if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+    glfwSetWindowShouldClose(window, 1);
+
+  // H toggles the frame time HUD
+  static bool h_pressed = false;
+  bool h = glfwGetKey(window, GLFW_KEY_H) == GLFW_PRESS;
+  if (h && !h_pressed)
+    window_state.hud = !window_state.hud;
+  h_pressed = h;
+}
+
+bool frame_log_open(const char *path)
+{
+  frame_recorder.log = fopen(path, "w");
+  if (!frame_recorder.log)
+  {
+    fprintf(stderr, "ERROR: could not open frame log '%s'\n", path);
+    return false;
+  }
+  size_t length = strlen(path);
+  frame_recorder.json = length > 5 && !strcmp(path + length - 5, ".json");
+  if (frame_recorder.json)
+    fprintf(frame_recorder.log, "[");
+  else
+  {
+    fprintf(frame_recorder.log, "frame");
+    for (int i = 0; i < NUM_PHASES; i++)
+      fprintf(frame_recorder.log, ",%s_ms", frame_phase_names[i]);
+    fprintf(frame_recorder.log, ",total_ms,p50_ms,p95_ms,p99_ms\n");
+  }
+  return true;
+}
+
+void frame_log_close()
+{
+  if (!frame_recorder.log)
+    return;
+  if (frame_recorder.json)
+    fprintf(frame_recorder.log, "\n]\n");
+  fclose(frame_recorder.log);
+  frame_recorder.log = NULL;
+}
+
+void frame_begin()
+{
+  for (int i = 0; i < NUM_PHASES; i++)
+    frame_recorder.current.phase_ms[i] = 0.0;
+  frame_recorder.mark = std::chrono::steady_clock::now();
+}
+
+// Time since the previous phase (or the beginning of the frame)
+void frame_phase(FramePhase phase)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  frame_recorder.current.phase_ms[phase] = std::chrono::duration<double, std::milli>(now - frame_recorder.mark).count();
+  frame_recorder.mark = now;
+}
+
+void frame_end()
+{
+  FrameRecorder &recorder = frame_recorder;
+  FrameTimings &timings = recorder.current;
+  timings.total_ms = 0.0;
+  for (int i = 0; i < NUM_PHASES; i++)
+    timings.total_ms += timings.phase_ms[i];
+  recorder.history[recorder.frames % frame_history_size] = timings;
+  recorder.frames++;
+
+  // Rolling percentiles
+  int n = (int)std::min<long>(recorder.frames, frame_history_size);
+  double totals[frame_history_size];
+  for (int i = 0; i < n; i++)
+    totals[i] = recorder.history[i].total_ms;
+  std::sort(totals, totals + n);
+  recorder.p50 = totals[(n - 1) * 50 / 100];
+  recorder.p95 = totals[(n - 1) * 95 / 100];
+  recorder.p99 = totals[(n - 1) * 99 / 100];
+
+  if (!recorder.log)
+    return;
+  if (recorder.json)
+  {
+    fprintf(recorder.log, "%s\n  {\"frame\": %ld", recorder.frames > 1 ? "," : "", recorder.frames - 1);
+    for (int i = 0; i < NUM_PHASES; i++)
+      fprintf(recorder.log, ", \"%s_ms\": %.4f", frame_phase_names[i], timings.phase_ms[i]);
+    fprintf(recorder.log, ", \"total_ms\": %.4f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f}",
+            timings.total_ms, recorder.p50, recorder.p95, recorder.p99);
+  }
+  else
+  {
+    fprintf(recorder.log, "%ld", recorder.frames - 1);
+    for (int i = 0; i < NUM_PHASES; i++)
+      fprintf(recorder.log, ",%.4f", timings.phase_ms[i]);
+    fprintf(recorder.log, ",%.4f,%.4f,%.4f,%.4f\n", timings.total_ms, recorder.p50, recorder.p95, recorder.p99);
+  }
+}
+
+bool setup_hud()
+{
+  const char *vertex_shader =
+      "#version 140\n"
+      "in vec2 position;\n" // In pixels
+      "in vec4 color;\n"
+      "out vec4 vs_color;\n"
+      "layout(std140) uniform Camera {\n"
+      "  mat4 view;\n"
+      "  mat4 projection;\n"
+      "  vec4 viewport;\n"
+      "  float time;\n"
+      "};\n"
+      "void main() {\n"
+      "  gl_Position = vec4(position / viewport.zw * 2.0 - 1.0, 0.0, 1.0);\n"
+      "  vs_color = color;\n"
+      "}\n";
+
+  const char *fragment_shader =
+      "#version 140\n"
+      "in vec4 vs_color;\n"
+      "out vec4 frag_color;\n"
+      "void main() {\n"
+      "  frag_color = vs_color;\n"
+      "}\n";
+
+  const char *attributes[] = {"position", "color", NULL};
+  if (!build_program(hud_program, vertex_shader, fragment_shader, attributes) ||
+      !bind_uniform_block(hud_program, "Camera", camera_binding, sizeof(CameraBlock)))
+    return false;
+
+  // Worst case: a bar segment per phase and frame, plus the text
+  if (!stream_create(hud_stream, (frame_history_size * NUM_PHASES + 4096) * 6 * sizeof(HudVertex)))
+    return false;
+
+  glGenVertexArrays(1, &hud_vao);
+  gl_state_bind_vertex_array(hud_vao);
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  gl_state_bind_vertex_array(0);
+  return true;
+}
+
+void hud_quad(float x, float y, float w, float h, const glm::vec4 &color)
+{
+  HudVertex corners[4] = {{glm::vec2(x, y), color}, {glm::vec2(x + w, y), color},
+                          {glm::vec2(x + w, y + h), color}, {glm::vec2(x, y + h), color}};
+  const int order[6] = {0, 1, 2, 0, 2, 3};
+  for (int i = 0; i < 6; i++)
+    hud_vertices.push_back(corners[order[i]]);
+}
+
+// 3x5 glyphs, rows from the top; only the characters the HUD needs
+const char *hud_glyph(char c)
+{
+  switch (c)
+  {
+  case '0': return "111101101101111";
+  case '1': return "010110010010111";
+  case '2': return "111001111100111";
+  case '3': return "111001111001111";
+  case '4': return "101101111001001";
+  case '5': return "111100111001111";
+  case '6': return "111100111101111";
+  case '7': return "111001001001001";
+  case '8': return "111101111101111";
+  case '9': return "111101111001111";
+  case '.': return "000000000000010";
+  case 'A': return "010101111101101";
+  case 'B': return "110101110101110";
+  case 'C': return "111100100100111";
+  case 'D': return "110101101101110";
+  case 'E': return "111100110100111";
+  case 'I': return "111010010010111";
+  case 'L': return "100100100100111";
+  case 'M': return "101111111101101";
+  case 'N': return "110101101101101";
+  case 'O': return "010101101101010";
+  case 'P': return "110101110100100";
+  case 'R': return "110101110101101";
+  case 'S': return "011100010001110";
+  case 'T': return "111010010010010";
+  case 'U': return "101101101101111";
+  case 'V': return "101101101101010";
+  case 'W': return "101101111111101";
+  default: return "000000000000000";
+  }
+}
+
+// Returns the x after the text
+float hud_text(float x, float y, float pixel, const char *text, const glm::vec4 &color)
+{
+  for (; *text; text++, x += pixel * 4)
+  {
+    const char *glyph = hud_glyph(*text);
+    for (int row = 0; row < 5; row++)
+      for (int column = 0; column < 3; column++)
+        if (glyph[row * 3 + column] == '1')
+          hud_quad(x + column * pixel, y + (4 - row) * pixel, pixel, pixel, color);
+  }
+  return x;
+}
+
+void submit_hud()
+{
+  const glm::vec4 phase_colors[NUM_PHASES] = {
+      glm::vec4(0.9f, 0.9f, 0.2f, 1.0f),  // input
+      glm::vec4(0.2f, 0.8f, 0.2f, 1.0f),  // update
+      glm::vec4(0.2f, 0.5f, 1.0f, 1.0f),  // render
+      glm::vec4(1.0f, 0.3f, 0.3f, 1.0f),  // swap
+      glm::vec4(0.8f, 0.4f, 1.0f, 1.0f)}; // poll
+  const glm::vec4 white(1.0f), grey(0.5f, 0.5f, 0.5f, 1.0f);
+  const float margin = 8.0f, bar_width = 2.0f, pixels_per_ms = 4.0f, pixel = 2.0f;
+  const FrameRecorder &recorder = frame_recorder;
+
+  hud_vertices.clear();
+
+  // Oldest frame on the left, phases stacked bottom-up
+  int n = (int)std::min<long>(recorder.frames, frame_history_size);
+  for (int i = 0; i < n; i++)
+  {
+    const FrameTimings &timings = recorder.history[(recorder.frames - n + i) % frame_history_size];
+    float y = margin;
+    for (int phase = 0; phase < NUM_PHASES; phase++)
+    {
+      float h = (float)timings.phase_ms[phase] * pixels_per_ms;
+      hud_quad(margin + i * bar_width, y, bar_width, h, phase_colors[phase]);
+      y += h;
+    }
+  }
+  // 60 and 30 fps marks
+  hud_quad(margin, margin + 1000.0f / 60.0f * pixels_per_ms, frame_history_size * bar_width, 1.0f, grey);
+  hud_quad(margin, margin + 1000.0f / 30.0f * pixels_per_ms, frame_history_size * bar_width, 1.0f, grey);
+
+  char text[128];
+  float y = margin + 1000.0f / 30.0f * pixels_per_ms + 8.0f;
+  float x = margin;
+  for (int phase = 0; phase < NUM_PHASES; phase++)
+  {
+    char name[16];
+    for (int i = 0; (name[i] = (char)toupper(frame_phase_names[phase][i])); i++)
+      ;
+    x = hud_text(x, y, pixel, name, phase_colors[phase]) + pixel * 4;
+  }
+  snprintf(text, sizeof(text), "P50 %.2f P95 %.2f P99 %.2f MS", recorder.p50, recorder.p95, recorder.p99);
+  hud_text(margin, y + pixel * 8, pixel, text, white);
+  y += pixel * 16;
+  if (culling.enabled || gpu_cull.enabled)
+  {
+    int visible = gpu_cull.enabled ? gpu_cull.visible : culling.num_visible;
+    snprintf(text, sizeof(text), "VISIBLE %d CULLED %d", visible, (int)instance_params.size() - visible);
+    hud_text(margin, y, pixel, text, white);
+    y += pixel * 8;
+  }
+  if (dynres.enabled)
+  {
+    snprintf(text, sizeof(text), "SCALE %.2f", dynres.scale);
+    hud_text(margin, y, pixel, text, white);
+  }
+
+  stream_begin_frame(hud_stream);
+  GLintptr offset;
+  HudVertex *vertices = (HudVertex *)stream_alloc(hud_stream, hud_vertices.size() * sizeof(HudVertex),
+                                                  sizeof(HudVertex), &offset);
+  if (!vertices)
+    return;
+  memcpy(vertices, hud_vertices.data(), hud_vertices.size() * sizeof(HudVertex));
+  stream_flush(hud_stream);
+
+  gl_state_bind_vertex_array(hud_vao);
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, hud_stream.buffer);
+  glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void *)(offset + offsetof(HudVertex, position)));
+  glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(HudVertex), (void *)(offset + offsetof(HudVertex, color)));
+
+  DrawItem item = {};
+  item.name = "hud";
+  item.program = hud_program.id;
+  item.vao = hud_vao;
+  item.mode = GL_TRIANGLES;
+  item.count = (GLsizei)hud_vertices.size();
+  item.instances = 1;
+  queue_submit(render_queue, item, LAYER_OVERLAY, 0.0f);
 }
 
 // Callback function to track window size and update viewport
+// On the main thread: the GL thread applies it with the next snapshot
 void glfw_window_size_callback(GLFWwindow *window, int width, int height)
 {
-  gl_width = width;
-  gl_height = height;
+  window_state.width = width;
+  window_state.height = height;
   printf("New viewport: (width: %d, height: %d)\n", width, height);
-  glViewport(0, 0, width, height); // Si aumentamos o reducimos la pantalla se ajusta
 }
@@ -1,3 +1,4 @@
+#include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <osg/Group>
@@ -7,13 +8,13 @@
 #include <osgDB/ReadFile>
 #include <osgViewer/Viewer>
 
-#include <osg/Timer>
 #include <osg/MatrixTransform>
 #include <osg/Texture2D>
 #include <osg/TexGen>
+#include <osg/Viewport>
+#include <osgGA/TrackballManipulator>
 
-// Crear un timer global
-static osg::Timer globalTimer;
+#include "frameclock.h"
 
 osg::ref_ptr<osg::PositionAttitudeTransform>
 CreateSubGraph(osg::ref_ptr<osg::Group> root,
@@ -35,9 +36,8 @@ void performTranslation(osg::Node *node, osg::NodeVisitor *nv, osg::Vec3 initial
     osg::PositionAttitudeTransform *pat = dynamic_cast<osg::PositionAttitudeTransform *>(node);
     if (pat)
     {
-        // Get animation time
-        // double currentTime = nv->getFrameStamp()->getSimulationTime();
-        double currentTime = globalTimer.time_s();
+        // Get animation time, the one main() passes to viewer.frame()
+        double currentTime = nv->getFrameStamp()->getSimulationTime();
         float f = (float)currentTime * 0.3f;
 
         float depth = sinf(1.3f * f) * cosf(1.5f * f) * 2.0f * desyncFactor;
@@ -93,6 +93,54 @@ public:
 
 int main(int argc, char *argv[])
 {
+    // Animation clock: wall time by default, fixed steps or the times of
+    // a session recorded by practica_cubo (or by --record) to render the
+    // same frames again. Only the time is replayed, not the camera input
+    FrameClock clock;
+    FILE *sessionLog = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "--clock") && i + 1 < argc)
+        {
+            const char *name = argv[++i];
+            if (!strcmp(name, clock_mode_names[CLOCK_WALL]))
+                clock.mode = CLOCK_WALL;
+            else if (!strcmp(name, clock_mode_names[CLOCK_FIXED]))
+                clock.mode = CLOCK_FIXED;
+            else
+            {
+                std::cerr << "Unknown clock '" << name << "'\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--dt") && i + 1 < argc)
+            clock.step = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc)
+        {
+            sessionLog = session_create(argv[++i]);
+            if (!sessionLog)
+            {
+                std::cerr << "Problem creating '" << argv[i] << "'\n";
+                exit(1);
+            }
+        }
+        else if (!strcmp(argv[i], "--replay") && i + 1 < argc)
+        {
+            if (!session_load(argv[++i], clock.session) || clock.session.empty())
+            {
+                std::cerr << "Problem reading '" << argv[i] << "'\n";
+                exit(1);
+            }
+            clock.mode = CLOCK_RECORDED;
+        }
+        else
+        {
+            std::cerr << "Usage: " << argv[0]
+                      << " [--clock wall|fixed] [--dt seconds] [--record session.txt | --replay session.txt]\n";
+            exit(1);
+        }
+    }
+
     // Load the model
     osg::ref_ptr<osg::Node> loadedModel = osgDB::readNodeFile("cube.obj");
 
@@ -161,6 +209,25 @@ int main(int argc, char *argv[])
     // Set background colour to black
     viewer.getCamera()->setClearColor(osg::Vec4(0.0f, 0.0f, 0.0f, 0.0f));
 
-    // Enter rendering loop
-    viewer.run();
+    // Enter rendering loop, with the time of the frame clock (viewer.run()
+    // would use the wall time)
+    viewer.setCameraManipulator(new osgGA::TrackballManipulator());
+    viewer.realize();
+    clock_start(clock);
+    while (!viewer.done() && !clock_finished(clock))
+    {
+        SessionFrame frame = {};
+        frame.time = clock_tick(clock);
+        const osg::Viewport *viewport = viewer.getCamera()->getViewport();
+        if (viewport)
+        {
+            frame.width = (int)viewport->width();
+            frame.height = (int)viewport->height();
+        }
+        if (sessionLog)
+            session_write(sessionLog, frame);
+        viewer.frame(frame.time);
+    }
+    if (sessionLog)
+        fclose(sessionLog);
 }
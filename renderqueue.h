@@ -0,0 +1,145 @@
+// Render queue: the scene submits draw items, which are radix-sorted by a
+// packed 64-bit key so draws sharing state end up next to each other, and
+// then issued changing only the state that differs from the previous item.
+// Key, from the most significant bit:
+//   layer:2 | depth test:1 | blend:1 | program:12 | texture:12 | vao:12 | depth:24
+// GL names are truncated to 12 bits, which at worst sorts a bit worse
+
+#ifndef RENDERQUEUE_H
+#define RENDERQUEUE_H
+
+#include <GL/glew.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+#include "glstate.h"
+#include "gpuprofiler.h"
+
+enum RenderLayer
+{
+  LAYER_OPAQUE,
+  LAYER_TRANSPARENT, // back to front
+  LAYER_OVERLAY
+};
+
+struct DrawItem
+{
+  uint64_t key;
+  const char *name; // GPU profiler scope
+  GLuint program, vao, texture; // texture 0: don't care
+  bool depth_test, blend;
+  bool indexed;
+  GLenum mode;
+  GLint first; // index or vertex; byte offset of the first indirect command
+  GLint base_vertex;
+  GLsizei count, instances;
+  GLuint indirect_buffer; // non-zero for an indirect draw
+  GLsizei draw_count;     // its commands; one is a glDrawElementsIndirect
+};
+
+struct RenderQueue
+{
+  std::vector<DrawItem> items;
+  std::vector<uint64_t> keys, keys_tmp;
+  std::vector<uint32_t> order, order_tmp;
+  int draw_calls = 0;    // in the last flush
+  int state_changes = 0; // in the last flush
+};
+
+// depth: normalized view depth, 0 (near) to 1 (far)
+inline void queue_submit(RenderQueue &queue, DrawItem item, RenderLayer layer, float depth)
+{
+  if (layer == LAYER_TRANSPARENT)
+    depth = 1.0f - depth;
+  uint64_t quantized_depth = (uint64_t)(std::min(std::max(depth, 0.0f), 1.0f) * 0xffffff);
+  item.key = (uint64_t)layer << 62 |
+             (uint64_t)item.depth_test << 61 |
+             (uint64_t)item.blend << 60 |
+             (uint64_t)(item.program & 0xfff) << 48 |
+             (uint64_t)(item.texture & 0xfff) << 36 |
+             (uint64_t)(item.vao & 0xfff) << 24 |
+             quantized_depth;
+  queue.items.push_back(item);
+}
+
+// LSD radix sort of the item indices, a byte per pass; passes where every
+// key has the same byte are skipped
+inline void queue_sort(RenderQueue &queue)
+{
+  size_t n = queue.items.size();
+  queue.keys.resize(n);
+  queue.keys_tmp.resize(n);
+  queue.order.resize(n);
+  queue.order_tmp.resize(n);
+  for (size_t i = 0; i < n; i++)
+  {
+    queue.keys[i] = queue.items[i].key;
+    queue.order[i] = (uint32_t)i;
+  }
+
+  for (int shift = 0; shift < 64; shift += 8)
+  {
+    size_t offsets[256] = {};
+    for (size_t i = 0; i < n; i++)
+      offsets[(queue.keys[i] >> shift) & 0xff]++;
+    if (n == 0 || offsets[(queue.keys[0] >> shift) & 0xff] == n)
+      continue;
+    size_t sum = 0;
+    for (int b = 0; b < 256; b++)
+    {
+      size_t count = offsets[b];
+      offsets[b] = sum;
+      sum += count;
+    }
+    for (size_t i = 0; i < n; i++)
+    {
+      size_t dst = offsets[(queue.keys[i] >> shift) & 0xff]++;
+      queue.keys_tmp[dst] = queue.keys[i];
+      queue.order_tmp[dst] = queue.order[i];
+    }
+    queue.keys.swap(queue.keys_tmp);
+    queue.order.swap(queue.order_tmp);
+  }
+}
+
+// Sort and issue every submitted item, then empty the queue
+inline void queue_flush(RenderQueue &queue)
+{
+  queue_sort(queue);
+  queue.draw_calls = 0;
+
+  int calls = gl_state_shadow().calls;
+  for (size_t i = 0; i < queue.order.size(); i++)
+  {
+    const DrawItem &item = queue.items[queue.order[i]];
+    gl_state_use_program(item.program);
+    gl_state_bind_vertex_array(item.vao);
+    if (item.texture)
+      gl_state_bind_texture(0, item.texture);
+    gl_state_enable(GL_DEPTH_TEST, item.depth_test);
+    gl_state_enable(GL_BLEND, item.blend);
+    if (item.blend)
+      gl_state_blend_func(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+    GpuScope scope(item.name);
+    if (item.indirect_buffer)
+    {
+      gl_state_bind_buffer(GL_DRAW_INDIRECT_BUFFER, item.indirect_buffer);
+      if (item.draw_count == 1)
+        glDrawElementsIndirect(item.mode, GL_UNSIGNED_INT, (void *)(intptr_t)item.first);
+      else
+        glMultiDrawElementsIndirect(item.mode, GL_UNSIGNED_INT, (void *)(intptr_t)item.first, item.draw_count, 0);
+    }
+    else if (item.indexed)
+      glDrawElementsInstancedBaseVertex(item.mode, item.count, GL_UNSIGNED_INT,
+                                        (void *)(item.first * sizeof(GLuint)), item.instances, item.base_vertex);
+    else
+      glDrawArraysInstanced(item.mode, item.first, item.count, item.instances);
+    queue.draw_calls++;
+  }
+  queue.state_changes = gl_state_shadow().calls - calls;
+
+  queue.items.clear();
+}
+
+#endif
@@ -0,0 +1,147 @@
+// Streaming buffer for per-frame dynamic data: persistently mapped with
+// glBufferStorage and split into one region per frame in flight, each one
+// guarded by a fence, so the CPU writes straight into memory the GPU is
+// not reading. Without ARB_buffer_storage the data goes through a staging
+// copy and glBufferSubData
+
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+#include <GL/glew.h>
+#include <stdio.h>
+#include <vector>
+#include "glstate.h"
+
+const int stream_frames = 3;
+
+struct StreamBuffer
+{
+  GLuint buffer = 0;
+  GLsizeiptr region_size = 0;
+  unsigned char *mapped = NULL; // whole buffer, NULL in the fallback path
+  std::vector<unsigned char> staging;
+  GLsync fences[stream_frames] = {};
+  int region = 0;
+  GLsizeiptr used = 0; // in the current region
+  int waits = 0;       // times the CPU had to wait for the GPU
+};
+
+inline void stream_destroy(StreamBuffer &stream)
+{
+  if (!stream.buffer)
+    return;
+  for (int i = 0; i < stream_frames; i++)
+  {
+    if (stream.fences[i])
+      glDeleteSync(stream.fences[i]);
+    stream.fences[i] = 0;
+  }
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, stream.buffer);
+  if (stream.mapped)
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  // Deleting a bound buffer unbinds it
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, 0);
+  glDeleteBuffers(1, &stream.buffer);
+  stream.buffer = 0;
+  stream.mapped = NULL;
+  stream.staging = std::vector<unsigned char>();
+}
+
+inline bool stream_create(StreamBuffer &stream, GLsizeiptr region_size)
+{
+  stream.region_size = region_size;
+  stream.region = 0;
+  stream.used = 0;
+  stream.waits = 0;
+  GLsizeiptr size = region_size * stream_frames;
+
+  glGetError();
+  glGenBuffers(1, &stream.buffer);
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, stream.buffer);
+  stream.mapped = NULL;
+  if (GLEW_ARB_buffer_storage)
+  {
+    // Coherent, so writes are visible to the GPU without explicit flushes
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER, size, NULL, flags);
+    stream.mapped = (unsigned char *)glMapBufferRange(GL_ARRAY_BUFFER, 0, size, flags);
+    if (!stream.mapped)
+    {
+      // Immutable storage takes no glBufferSubData: a new buffer for the
+      // fallback path
+      fprintf(stderr, "WARNING: could not map streaming buffer, copying through glBufferSubData\n");
+      gl_state_bind_buffer(GL_ARRAY_BUFFER, 0);
+      glDeleteBuffers(1, &stream.buffer);
+      glGenBuffers(1, &stream.buffer);
+      gl_state_bind_buffer(GL_ARRAY_BUFFER, stream.buffer);
+    }
+  }
+  if (!stream.mapped)
+  {
+    glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+    stream.staging.resize(region_size);
+  }
+
+  if (glGetError() != GL_NO_ERROR)
+  {
+    fprintf(stderr, "ERROR: could not allocate a %ld byte streaming buffer\n", (long)size);
+    stream_destroy(stream);
+    return false;
+  }
+  return true;
+}
+
+// Move to the next region, waiting until the GPU is done with the frame
+// that last used it (stream_frames - 1 frames ago)
+inline void stream_begin_frame(StreamBuffer &stream)
+{
+  stream.region = (stream.region + 1) % stream_frames;
+  stream.used = 0;
+
+  GLsync &fence = stream.fences[stream.region];
+  if (!fence)
+    return;
+  GLenum status = glClientWaitSync(fence, 0, 0);
+  if (status == GL_TIMEOUT_EXPIRED)
+  {
+    stream.waits++;
+    while (status == GL_TIMEOUT_EXPIRED)
+      status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+  }
+  glDeleteSync(fence);
+  fence = 0;
+}
+
+// Space for 'size' bytes in the current region; 'offset' is where it is
+// in the buffer, to set up attribute pointers or buffer ranges
+inline void *stream_alloc(StreamBuffer &stream, GLsizeiptr size, GLsizeiptr alignment, GLintptr *offset)
+{
+  GLsizeiptr start = (stream.used + alignment - 1) / alignment * alignment;
+  if (start + size > stream.region_size)
+  {
+    fprintf(stderr, "ERROR: streaming buffer region overflow (%ld bytes)\n", (long)(start + size));
+    return NULL;
+  }
+  stream.used = start + size;
+  *offset = stream.region * stream.region_size + start;
+  if (stream.mapped)
+    return stream.mapped + *offset;
+  return stream.staging.data() + start;
+}
+
+// Make this frame's data visible to the GPU before drawing with it
+inline void stream_flush(StreamBuffer &stream)
+{
+  if (stream.mapped || !stream.used)
+    return;
+  gl_state_bind_buffer(GL_ARRAY_BUFFER, stream.buffer);
+  glBufferSubData(GL_ARRAY_BUFFER, stream.region * stream.region_size, stream.used, stream.staging.data());
+}
+
+// Fence the region after the last command reading from it
+inline void stream_end_frame(StreamBuffer &stream)
+{
+  stream.fences[stream.region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+#endif